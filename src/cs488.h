@@ -8,9 +8,12 @@
 
 
 // OpenGL
+// (define CS488_HEADLESS to build without a window, e.g., for the offline renderer in headless.cpp)
+#ifndef CS488_HEADLESS
 #define GLEW_STATIC
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#endif
 
 
 // image loader and writer
@@ -34,17 +37,43 @@ using namespace linalg::aliases;
 #include <vector>
 #include <cfloat>
 #include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <cstring>
+#include <algorithm>
+#include <new>
+#include <string>
+
+// memory-mapped BVH cache files
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// SSE is used for ray packets when the target supports it
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define CS488_SSE
+#include <emmintrin.h>
+#endif
 
 //#define LAMBERTIAN_SHADOW // Define this for shadow tracing, comment out if not
+//#define SAHBVH // use this in once you have SAH-BVH (binned SAH by default, see globalBVHBuilder)
 
+#ifndef CS488_HEADLESS
 // main window
 static GLFWwindow* globalGLFWindow;
+#endif
 
 
-// window size and resolution
-// (do not make it too large - will be slow!)
-constexpr int globalWidth = 512;
-constexpr int globalHeight = 384;
+// default window size and resolution
+// (the resolution is the size of FrameBuffer, set at runtime with setResolution() before the window is opened)
+constexpr int globalDefaultWidth = 512;
+constexpr int globalDefaultHeight = 384;
 
 
 // degree and radian
@@ -58,13 +87,62 @@ constexpr float Epsilon = 2e-6f; // 5e-5f;
 constexpr float miniEps = 1e-6f;
 constexpr float edgeEps = 1e-8f;
 
+// multithreaded ray tracing
+// the frame is split into square tiles that are handed out to the worker threads
+constexpr int globalTileSize = 16;
+int globalNumThreads = std::max(1, int(std::thread::hardware_concurrency()));
+bool globalShowThreadStats = true;
+bool globalShowRenderTime = true;
+
+// time budget of a ray traced frame in ms (0 = render every pixel no matter how long it takes)
+// the frame is refined coarse-to-fine and whatever is finished at the deadline is shown
+// (progressive rendering ignores it)
+float globalFrameBudget = 0.0f;
+constexpr int globalCoarsestBlock = 8; // first pass traces one pixel per 8x8 block
+
+// trace primary rays as 2x2 packets through the BVH (only with SSE)
+bool globalPacketTracing = true;
+
+// shadow rays ignore triangles facing away from them
+bool globalCullShadowBackfaces = false;
+
+// how the BVHs are split (H key cycles through them, the BVHs are then rebuilt)
+// BVH_SAH evaluates every split position and is quadratic per node, BVH_BINNED_SAH evaluates BVHBinNum bins,
+// BVH_LBVH sorts the triangles along a Morton curve and is meant for geometry that changes every frame,
+// BVH_SBVH also splits the space, so that a triangle can be in several leaves (for large or thin triangles)
+enum enumBVHBuilder {
+	BVH_MEDIAN,
+	BVH_SAH,
+	BVH_BINNED_SAH,
+	BVH_LBVH,
+	BVH_SBVH
+};
+static const char* BVHBuilderNames[] = { "median", "SAH", "binned SAH", "LBVH", "SBVH" };
+#ifdef SAHBVH
+enumBVHBuilder globalBVHBuilder = BVH_BINNED_SAH;
+#else
+enumBVHBuilder globalBVHBuilder = BVH_MEDIAN;
+#endif
+enumBVHBuilder globalDynamicBVHBuilder = BVH_LBVH; // for the meshes that are rebuilt every frame (particles)
+int globalLBVHMortonBits = 30; // 30 (10 bits per axis) or 63 (21 bits per axis)
+bool globalLBVHTreelets = false; // restructure the LBVH with treelets of up to 7 leaves (slower build, better tree)
+float globalSBVHDuplication = 0.3f; // BVH_SBVH: at most this fraction of the triangles is added again by spatial splits
+float globalBVHRefitThreshold = 1.5f; // moved meshes are refitted until the SAH cost exceeds this factor of the cost after their last build (0: always rebuild)
+std::string globalBVHCacheDir; // BVHs of meshes loaded from files are reused from and saved to this directory (empty: no cache)
+bool globalWideBVH = false; // also build 4-wide BVHs and trace single rays with them (J key, needs SSE)
+
+// path depth limits for specular bounces (the level at which metal/glass stop and return the environment)
+int globalMaxMetalLevel = 4;
+int globalMaxGlassLevel = 5;
+// terminate a path once all the components of its throughput fall below this (0 = never)
+float globalThroughputThreshold = 0.0f;
+
 // amount the camera moves with a mouse and a keyboard
 constexpr float ANGFACT = 0.2f;
 constexpr float SCLFACT = 0.1f;
 
 
 // fixed camera parameters
-constexpr float globalAspectRatio = float(globalWidth / float(globalHeight));
 constexpr float globalFOV = 45.0f; // vertical field of view
 constexpr float globalDepthMin = Epsilon; // for rasterization
 constexpr float globalDepthMax = 100.0f; // for rasterization
@@ -88,6 +166,51 @@ float3 globalRight; // should always be normalize(cross(globalViewDir, globalUp)
 bool globalShowRaytraceProgress = false; // for ray tracing
 
 
+// snapshot of the dynamic camera parameters (to find out if the camera has moved)
+struct CameraState {
+	float3 eye, lookat, up;
+
+	static CameraState current() {
+		CameraState camera;
+		camera.eye = globalEye;
+		camera.lookat = globalLookat;
+		camera.up = globalUp;
+		return camera;
+	}
+
+	bool operator==(const CameraState& other) const {
+		return (eye == other.eye) && (lookat == other.lookat) && (up == other.up);
+	}
+	bool operator!=(const CameraState& other) const {
+		return !(*this == other);
+	}
+};
+
+
+// temporal reprojection (ray tracing)
+bool globalReprojection = false;
+int globalReprojectionMaxAge = 8; // re-trace a pixel after it has been reused this many frames in a row
+
+
+// low-resolution preview while the camera moves (ray tracing)
+int globalPreviewBlock = 4; // trace one pixel per NxN block while the camera moves (1 = always full resolution)
+int globalPreviewSettleFrames = 3; // back to full resolution once the camera has been still for this many frames
+int globalCameraStillFrames = 1 << 30; // frames since the camera last moved (updated by the main loop)
+static CameraState globalLastCamera;
+static bool globalLastCameraValid = false;
+
+static void updateCameraMotion() {
+	const CameraState camera = CameraState::current();
+	if (globalLastCameraValid && (camera != globalLastCamera)) {
+		globalCameraStillFrames = 0;
+	} else if (globalCameraStillFrames < (1 << 30)) {
+		globalCameraStillFrames++;
+	}
+	globalLastCamera = camera;
+	globalLastCameraValid = true;
+}
+
+
 // mouse event
 static bool mouseLeftPressed;
 static double m_mouseX = 0.0;
@@ -107,6 +230,7 @@ static GifWriter globalGIFfile;
 constexpr int globalGIFdelay = 1;
 
 
+#ifndef CS488_HEADLESS
 // OpenGL related data (do not modify it if it is working)
 static GLuint GLFrameBufferTexture;
 static GLuint FSDraw;
@@ -122,23 +246,84 @@ static const std::string FSDrawSource = R"(
     }
 )";
 static const char* PFSDrawSource = FSDrawSource.c_str();
+#endif
 
 
 
 // fast random number generator based pcg32_fast
+// (each thread has its own state, so it is safe to call from anywhere, but every thread starts with the same sequence.
+// the renderers use the counter-based streams below instead)
 #include <stdint.h>
 namespace PCG32 {
-	static uint64_t mcg_state = 0xcafef00dd15ea5e5u;	// must be odd
+	static thread_local uint64_t mcg_state = 0xcafef00dd15ea5e5u;	// must be odd
 	static uint64_t const multiplier = 6364136223846793005u;
-	uint32_t pcg32_fast(void) {
-		uint64_t x = mcg_state;
+	uint32_t pcg32_fast(uint64_t& state) {
+		uint64_t x = state;
 		const unsigned count = (unsigned)(x >> 61);
-		mcg_state = x * multiplier;
+		state = x * multiplier;
 		x ^= x >> 22;
 		return (uint32_t)(x >> (22 + count));
 	}
+	uint32_t pcg32_fast(void) {
+		return pcg32_fast(mcg_state);
+	}
+	float rand(uint64_t& state) {
+		return float(double(pcg32_fast(state)) / 4294967296.0);
+	}
 	float rand() {
-		return float(double(pcg32_fast()) / 4294967296.0);
+		return rand(mcg_state);
+	}
+
+	// counter-based random numbers for rendering
+	// the n-th number of the stream of a (pixel, sample index, frame) triple is a hash of the stream key and n.
+	// there is no state to share or to advance, so a render gives the same image with any number of threads
+	// and in any order of pixels (and in any number of processes)
+	inline uint32_t hash(uint32_t x) {
+		// "lowbias32" integer hash by Chris Wellons
+		x ^= x >> 16;
+		x *= 0x7feb352du;
+		x ^= x >> 15;
+		x *= 0x846ca68bu;
+		x ^= x >> 16;
+		return x;
+	}
+	inline uint32_t streamKey(const uint32_t pixel, const uint32_t sample, const uint32_t frame) {
+		return hash(hash(hash(frame) + sample) + pixel);
+	}
+	inline uint32_t counterOffset(const uint32_t n) {
+		return n * 0x9e3779b9u;
+	}
+	// uniform in [0, 1) (24 bits, so that the conversion to float is exact)
+	inline float rand(const uint32_t key, const uint32_t n) {
+		return float(hash(key + counterOffset(n)) >> 8) * (1.0f / 16777216.0f);
+	}
+
+#ifdef CS488_SSE
+	// 32-bit multiplication of each lane (SSE2 only has 32 x 32 -> 64 bits)
+	inline __m128i mul32(const __m128i a, const __m128i b) {
+		const __m128i even = _mm_mul_epu32(a, b);
+		const __m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+		return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+	}
+	inline __m128i hash4(__m128i x) {
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		x = mul32(x, _mm_set1_epi32(int(0x7feb352du)));
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 15));
+		x = mul32(x, _mm_set1_epi32(int(0x846ca68bu)));
+		x = _mm_xor_si128(x, _mm_srli_epi32(x, 16));
+		return x;
+	}
+#endif
+
+	// the n-th numbers of four streams at once (the same values as rand(keys[k], n))
+	inline void rand4(float values[4], const uint32_t keys[4], const uint32_t n) {
+#ifdef CS488_SSE
+		const __m128i x = _mm_add_epi32(_mm_loadu_si128((const __m128i*)keys), _mm_set1_epi32(int(counterOffset(n))));
+		const __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(hash4(x), 8)), _mm_set1_ps(1.0f / 16777216.0f));
+		_mm_storeu_ps(values, v);
+#else
+		for (int k = 0; k < 4; k++) values[k] = rand(keys[k], n);
+#endif
 	}
 }
 
@@ -163,6 +348,10 @@ public:
 		return pow(r, 1.0f / gamma);
 	}
 
+	float aspectRatio() const {
+		return float(width) / float(height);
+	}
+
 	void resize(const int newWdith, const int newHeight) {
 		this->pixels.resize(newWdith * newHeight);
 		this->depths.resize(newWdith * newHeight);
@@ -235,15 +424,132 @@ public:
 };
 
 // main image buffer to be displayed
-Image FrameBuffer(globalWidth, globalHeight);
+Image FrameBuffer(globalDefaultWidth, globalDefaultHeight);
 
-// you may want to use the following later for progressive ray tracing
-Image AccumulationBuffer(globalWidth, globalHeight);
+// progressive ray tracing
+// AccumulationBuffer holds the sum of all the samples taken so far and FrameBuffer shows their mean
+Image AccumulationBuffer(globalDefaultWidth, globalDefaultHeight);
 unsigned int sampleCount = 0;
+bool globalProgressive = false;
+int globalSamplesPerFrame = 1; // jittered samples per pixel added in each frame
+unsigned int globalTargetSamples = 0; // stop refining after this many samples per pixel (0 = never stop)
+unsigned int globalFrameSeed = 0; // offsets the random numbers of the jittered samples (see pixelJitter)
+
+// the frame part of the jitter streams: the frame of an animation (globalFrameCount, a -batch line in the headless
+// renderer) mixed with globalFrameSeed, so that consecutive frames do not repeat the same jitter pattern
+static uint32_t frameStreamKey() {
+	return PCG32::hash(uint32_t(globalFrameCount)) + globalFrameSeed;
+}
+
+// adaptive sampling
+// new samples only go to pixels whose relative error is still above globalAdaptiveThreshold
+bool globalAdaptiveSampling = false;
+float globalAdaptiveThreshold = 0.02f; // standard error of the mean luminance relative to the mean
+unsigned int globalAdaptiveMinSamples = 16; // never trust the variance estimate of fewer samples
+bool globalShowConvergedMask = false; // debug view: converged pixels dimmed, the others red
+
+
+// per-pixel sample statistics kept next to AccumulationBuffer
+class PixelStatistics {
+public:
+	std::vector<float> sumSquares; // sum of the squared luminance of all the samples
+	std::vector<unsigned int> counts; // number of samples
+	std::vector<unsigned char> converged; // the converged-pixel mask
+	int width = 0, height = 0;
+	int convergedNum = 0;
+
+	static float luminance(const float3& c) {
+		return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+	}
+
+	void resize(const int newWidth, const int newHeight) {
+		sumSquares.resize(newWidth * newHeight);
+		counts.resize(newWidth * newHeight);
+		converged.resize(newWidth * newHeight);
+		width = newWidth;
+		height = newHeight;
+	}
+
+	void clear() {
+		std::fill(sumSquares.begin(), sumSquares.end(), 0.0f);
+		std::fill(counts.begin(), counts.end(), 0u);
+		std::fill(converged.begin(), converged.end(), (unsigned char)0);
+		convergedNum = 0;
+	}
+
+	PixelStatistics(int _width = 0, int _height = 0) {
+		this->resize(_width, _height);
+		this->clear();
+	}
+
+	// relative standard error of the mean luminance of pixel (i, j) with "sum" being the sum of its samples
+	float relativeError(const int i, const int j, const float3& sum) const {
+		const int k = i + j * width;
+		const float n = float(counts[k]);
+		if (n < 2.0f) return FLT_MAX;
+		const float mean = luminance(sum) / n;
+		const float variance = std::max(0.0f, (sumSquares[k] / n - mean * mean) * n / (n - 1.0f));
+		return sqrtf(variance / n) / (mean + 0.01f);
+	}
+};
+PixelStatistics AccumulationStats(globalDefaultWidth, globalDefaultHeight);
+
+
+// change the render resolution (resizes all the per-pixel buffers)
+static void setResolution(const int width, const int height) {
+	const int w = std::max(1, width), h = std::max(1, height);
+	FrameBuffer.resize(w, h);
+	FrameBuffer.clear();
+	AccumulationBuffer.resize(w, h);
+	AccumulationBuffer.clear();
+	AccumulationStats.resize(w, h);
+	AccumulationStats.clear();
+	sampleCount = 0;
+}
+
+static void resetAccumulation() {
+	AccumulationBuffer.clear();
+	AccumulationStats.clear();
+	sampleCount = 0;
+}
+
+// idle-frame detection (see CS488Window::start)
+bool globalFrameComplete = false; // the frame buffer holds the final image of the current scene (set by the renderers)
+bool globalRedraw = true; // a render setting has changed, so the frame has to be rendered again
+bool globalRedisplay = true; // the window needs the frame buffer again (e.g., after being uncovered)
+
+static bool progressiveDone() {
+	if (!globalProgressive) return false;
+	if ((globalTargetSamples > 0) && (sampleCount >= globalTargetSamples)) return true;
+	return globalAdaptiveSampling && (sampleCount > 0) && (AccumulationStats.convergedNum == AccumulationStats.width * AccumulationStats.height);
+}
+
+// show the mean of the accumulated samples of pixel (i, j)
+static void resolvePixel(const int i, const int j) {
+	const int k = i + j * AccumulationStats.width;
+	const unsigned int n = AccumulationStats.counts[k];
+	float3 c = (n > 0) ? AccumulationBuffer.pixel(i, j) / float(n) : float3(0.0f);
+	if (globalShowConvergedMask) {
+		c = AccumulationStats.converged[k] ? 0.25f * c : float3(1.0f, 0.0f, 0.0f);
+	}
+	FrameBuffer.pixel(i, j) = c;
+}
+
+static void resolveAccumulation() {
+	for (int j = 0; j < FrameBuffer.height; j++) {
+		for (int i = 0; i < FrameBuffer.width; i++) {
+			resolvePixel(i, j);
+		}
+	}
+}
 
 // Environment map
 static Image EnvironMap;
 
+static void moveLight(const float3& offset);
+static void rebuildBVHs();
+
+#ifndef CS488_HEADLESS
 // keyboard events (you do not need to modify it unless you want to)
 void keyFunc(GLFWwindow* window, int key, int scancode, int action, int mods) {
 	if (action == GLFW_PRESS || action == GLFW_REPEAT) {
@@ -255,8 +561,7 @@ void keyFunc(GLFWwindow* window, int key, int scancode, int action, int mods) {
 					globalRenderType = RENDER_RASTERIZE;
 				} else if (globalRenderType == RENDER_RASTERIZE) {
 					printf("(Switched to ray tracing)\n");
-					AccumulationBuffer.clear();
-					sampleCount = 0;
+					resetAccumulation();
 					glfwSetWindowTitle(window, "Ray tracing mode");
 					globalRenderType = RENDER_RAYTRACE;
 				}
@@ -277,7 +582,7 @@ void keyFunc(GLFWwindow* window, int key, int scancode, int action, int mods) {
 					char fileName[1024];
 					sprintf(fileName, "output%d.gif", int(1000.0 * PCG32::rand()));
 					printf("Saving \"%s\"...\n", fileName);
-					GifBegin(&globalGIFfile, fileName, globalWidth, globalHeight, globalGIFdelay);
+					GifBegin(&globalGIFfile, fileName, FrameBuffer.width, FrameBuffer.height, globalGIFdelay);
 					globalRecording = true;
 					printf("(Recording started)\n");
 				} else {
@@ -287,6 +592,66 @@ void keyFunc(GLFWwindow* window, int key, int scancode, int action, int mods) {
 				}
 			break;}
 
+			case GLFW_KEY_P: {
+				globalProgressive = !globalProgressive;
+				resetAccumulation();
+				printf("(Progressive ray tracing %s)\n", globalProgressive ? "on" : "off");
+			break;}
+
+			case GLFW_KEY_V: {
+				globalAdaptiveSampling = !globalAdaptiveSampling;
+				resetAccumulation();
+				printf("(Adaptive sampling %s)\n", globalAdaptiveSampling ? "on" : "off");
+			break;}
+
+			case GLFW_KEY_M: {
+				globalShowConvergedMask = !globalShowConvergedMask;
+				if (globalProgressive) resolveAccumulation();
+			break;}
+
+			case GLFW_KEY_B: {
+				// cycle through the frame budgets
+				if (globalFrameBudget == 0.0f) globalFrameBudget = 100.0f;
+				else if (globalFrameBudget == 100.0f) globalFrameBudget = 16.0f;
+				else globalFrameBudget = 0.0f;
+				printf("(Frame budget: %s)\n", (globalFrameBudget > 0.0f) ? std::to_string(int(globalFrameBudget)).append(" ms").c_str() : "none");
+			break;}
+
+			case GLFW_KEY_H: {
+				// cycle through the BVH builders
+				globalBVHBuilder = enumBVHBuilder((globalBVHBuilder + 1) % 5);
+				printf("(BVH builder: %s)\n", BVHBuilderNames[globalBVHBuilder]);
+				rebuildBVHs();
+			break;}
+
+			case GLFW_KEY_J: {
+				// binary or 4-wide BVHs for the single rays
+				globalWideBVH = !globalWideBVH;
+				printf("(BVH width: %d)\n", globalWideBVH ? 4 : 2);
+				rebuildBVHs();
+			break;}
+
+			case GLFW_KEY_L: {
+				// cycle through the preview block sizes
+				globalPreviewBlock = (globalPreviewBlock == 1) ? 4 : ((globalPreviewBlock == 4) ? 8 : 1);
+				printf("(Preview while moving: %s)\n", (globalPreviewBlock > 1) ? (std::to_string(globalPreviewBlock) + "x" + std::to_string(globalPreviewBlock) + " blocks").c_str() : "off");
+			break;}
+
+			case GLFW_KEY_T: {
+				globalReprojection = !globalReprojection;
+				printf("(Temporal reprojection %s)\n", globalReprojection ? "on" : "off");
+			break;}
+
+			case GLFW_KEY_EQUAL: {
+				globalSamplesPerFrame++;
+				printf("(%d samples per frame)\n", globalSamplesPerFrame);
+			break;}
+
+			case GLFW_KEY_MINUS: {
+				globalSamplesPerFrame = std::max(1, globalSamplesPerFrame - 1);
+				printf("(%d samples per frame)\n", globalSamplesPerFrame);
+			break;}
+
 			case GLFW_KEY_W: {
 				globalEye += SCLFACT * globalViewDir;
 				globalLookat += SCLFACT * globalViewDir;
@@ -317,8 +682,26 @@ void keyFunc(GLFWwindow* window, int key, int scancode, int action, int mods) {
 				globalLookat += SCLFACT * globalRight;
 			break;}
 
+			// move the first light source (relit from the G-buffer while the camera stays put)
+			case GLFW_KEY_LEFT: moveLight(-SCLFACT * globalRight); break;
+			case GLFW_KEY_RIGHT: moveLight(SCLFACT * globalRight); break;
+			case GLFW_KEY_UP: moveLight(SCLFACT * globalUp); break;
+			case GLFW_KEY_DOWN: moveLight(-SCLFACT * globalUp); break;
+			case GLFW_KEY_PAGE_UP: moveLight(SCLFACT * globalViewDir); break;
+			case GLFW_KEY_PAGE_DOWN: moveLight(-SCLFACT * globalViewDir); break;
+
 			default: break;
 		}
+
+		// the camera moved, so the accumulated samples are no longer valid
+		if ((key == GLFW_KEY_W) || (key == GLFW_KEY_S) || (key == GLFW_KEY_Q) || (key == GLFW_KEY_Z) || (key == GLFW_KEY_A) || (key == GLFW_KEY_D)) {
+			resetAccumulation();
+		}
+
+		// the other keys change how the frame looks
+		if ((key != GLFW_KEY_I) && (key != GLFW_KEY_F) && (key != GLFW_KEY_ESCAPE)) {
+			globalRedraw = true;
+		}
 	}
 }
 
@@ -332,8 +715,7 @@ void mouseButtonFunc(GLFWwindow* window, int button, int action, int mods) {
 		} else if (action == GLFW_RELEASE) {
 			mouseLeftPressed = false;
 			if (globalRenderType == RENDER_RAYTRACE) {
-				AccumulationBuffer.clear();
-				sampleCount = 0;
+				resetAccumulation();
 			}
 		}
 	}
@@ -341,6 +723,13 @@ void mouseButtonFunc(GLFWwindow* window, int button, int action, int mods) {
 
 
 
+// window refresh events (the window was uncovered or resized)
+void refreshFunc(GLFWwindow* window) {
+	globalRedisplay = true;
+}
+
+
+
 // mouse button events (you do not need to modify it unless you want to)
 void cursorPosFunc(GLFWwindow* window, double mouse_x, double mouse_y) {
 	if (mouseLeftPressed) {
@@ -372,14 +761,14 @@ void cursorPosFunc(GLFWwindow* window, double mouse_x, double mouse_y) {
 		m_mouseY = mouse_y;
 
 		if (globalRenderType == RENDER_RAYTRACE) {
-			AccumulationBuffer.clear();
-			sampleCount = 0;
+			resetAccumulation();
 		}
 	} else {
 		m_mouseX = mouse_x;
 		m_mouseY = mouse_y;
 	}
 }
+#endif
 
 
 
@@ -387,6 +776,13 @@ void cursorPosFunc(GLFWwindow* window, double mouse_x, double mouse_y) {
 class PointLightSource {
 public:
 	float3 position, wattage;
+
+	bool operator==(const PointLightSource& other) const {
+		return (position == other.position) && (wattage == other.wattage);
+	}
+	bool operator!=(const PointLightSource& other) const {
+		return !(*this == other);
+	}
 };
 
 
@@ -513,30 +909,89 @@ public:
 
 
 
+// the light-independent part of a path traced from the eye (filled in by shade)
+// specular bounces do not depend on the lights, so the path is lit either at one Lambertian surface
+// ("hit" scaled by "throughput") or not at all (it ends at the environment and sees "radiance")
+class ShadingRecord {
+public:
+	HitInfo hit; // material is nullptr if the path does not end at a Lambertian surface
+	float3 viewDir;
+	float3 throughput;
+	float3 radiance;
+	int level; // number of specular bounces before "hit" (0 = the eye ray hit it directly)
+};
+
+
+
+#ifdef CS488_SSE
+// four rays in SoA layout, traced together through the BVH
+constexpr int PacketSize = 4;
+class RayPacket {
+public:
+	__m128 ox, oy, oz;
+	__m128 dx, dy, dz;
+	__m128 idx, idy, idz; // inverse directions for the slab test
+
+	RayPacket(const Ray rays[PacketSize]) {
+		ox = _mm_setr_ps(rays[0].o.x, rays[1].o.x, rays[2].o.x, rays[3].o.x);
+		oy = _mm_setr_ps(rays[0].o.y, rays[1].o.y, rays[2].o.y, rays[3].o.y);
+		oz = _mm_setr_ps(rays[0].o.z, rays[1].o.z, rays[2].o.z, rays[3].o.z);
+		dx = _mm_setr_ps(rays[0].d.x, rays[1].d.x, rays[2].d.x, rays[3].d.x);
+		dy = _mm_setr_ps(rays[0].d.y, rays[1].d.y, rays[2].d.y, rays[3].d.y);
+		dz = _mm_setr_ps(rays[0].d.z, rays[1].d.z, rays[2].d.z, rays[3].d.z);
+		const __m128 one = _mm_set1_ps(1.0f);
+		idx = _mm_div_ps(one, dx);
+		idy = _mm_div_ps(one, dy);
+		idz = _mm_div_ps(one, dz);
+	}
+};
+
+
+// closest hits of a ray packet
+// only the triangle and its barycentric coordinates are recorded during traversal,
+// the full HitInfo is computed once per ray at the end
+class PacketHit {
+public:
+	alignas(16) float t[PacketSize];
+	int object[PacketSize];
+	int triangle[PacketSize];
+	float beta[PacketSize], gamma[PacketSize];
+
+	PacketHit() {
+		for (int k = 0; k < PacketSize; k++) {
+			t[k] = FLT_MAX;
+			object[k] = -1;
+			triangle[k] = -1;
+		}
+	}
+};
+#endif
+
+
+
 // axis-aligned bounding box
 class AABB {
 private:
-	float3 minp, maxp, size;
+	float3 minp, maxp;
 
 public:
-	float3 get_minp() { return minp; };
-	float3 get_maxp() { return maxp; };
-	float3 get_size() { return size; };
+	float3 get_minp() const { return minp; };
+	float3 get_maxp() const { return maxp; };
+	float3 get_size() const { return (minp.x <= maxp.x) ? (maxp - minp) : float3(0.0f); };
 
 
 	AABB() {
 		minp = float3(FLT_MAX);
 		maxp = float3(-FLT_MAX);
-		size = float3(0.0f);
 	}
 
 	void reset() {
 		minp = float3(FLT_MAX);
 		maxp = float3(-FLT_MAX);
-		size = float3(0.0f);
 	}
 
 	int getLargestAxis() const {
+		const float3 size = get_size();
 		if ((size.x > size.y) && (size.x > size.z)) {
 			return 0;
 		} else if (size.y > size.z) {
@@ -554,11 +1009,16 @@ public:
 		if (maxp.x < v.x) maxp.x = v.x;
 		if (maxp.y < v.y) maxp.y = v.y;
 		if (maxp.z < v.z) maxp.z = v.z;
+	}
 
-		size = maxp - minp;
+	void fit(const AABB& box) {
+		if (box.minp.x > box.maxp.x) return; // empty
+		fit(box.minp);
+		fit(box.maxp);
 	}
 
 	float area() const {
+		const float3 size = get_size();
 		return (2.0f * (size.x * size.y + size.y * size.z + size.z * size.x));
 	}
 
@@ -566,6 +1026,10 @@ public:
 	bool intersect(HitInfo& minHit, const Ray& ray) const {
 		// set minHit.t as the distance to the intersection point
 		// return true/false if the ray hits or not
+		return intersect(minHit.t, ray);
+	}
+
+	bool intersect(float& tNear, const Ray& ray) const {
 		float tx1 = (minp.x - ray.o.x) / ray.d.x;
 		float ty1 = (minp.y - ray.o.y) / ray.d.y;
 		float tz1 = (minp.z - ray.o.z) / ray.d.z;
@@ -598,7 +1062,7 @@ public:
 		if (t1 > t2) return false;
 		if ((t1 < 0.0) && (t2 < 0.0)) return false;
 
-		minHit.t = t1;
+		tNear = t1;
 		return true;
 	}
 };
@@ -619,12 +1083,44 @@ struct Triangle {
 
 
 // triangle mesh
-static float3 shade(const HitInfo& hit, const float3& viewDir, const int level = 0);
+static float3 shade(const HitInfo& hit, const float3& viewDir, const int level = 0, ShadingRecord* record = nullptr);
+static float3 shadeSurface(const HitInfo& hit, const float3& viewDir, const int level);
+static float lightShadowRay(const HitInfo& hit, const int i, Ray& shadowRay);
+static float3 lightContribution(const HitInfo& hit, const float3& viewDir, const int i);
+// 64-bit hash of a byte string (FNV-1a over 8-byte words) for cache keys; it is fast, not collision resistant
+static uint64_t hashBytes(const void* data, const size_t size, uint64_t h = 0xcbf29ce484222325ull) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t i = 0;
+	for (; i + 8 <= size; i += 8) {
+		uint64_t word;
+		memcpy(&word, bytes + i, 8);
+		h = (h ^ word) * 0x100000001b3ull;
+		h ^= h >> 29;
+	}
+	for (; i < size; i++) h = (h ^ bytes[i]) * 0x100000001b3ull;
+	return h ^ size;
+}
+
+// hash of the contents of a file (0 if it cannot be read)
+static uint64_t hashFile(const char* fileName) {
+	FILE* fp = fopen(fileName, "rb");
+	if (!fp) return 0;
+	std::vector<unsigned char> buffer(1 << 20);
+	uint64_t h = 0xcbf29ce484222325ull;
+	size_t n;
+	while ((n = fread(buffer.data(), 1, buffer.size(), fp)) > 0) h = hashBytes(buffer.data(), n, h);
+	fclose(fp);
+	return (h == 0) ? 1 : h;
+}
+
+
 class TriangleMesh {
 public:
 	std::vector<Triangle> triangles;
 	std::vector<Material> materials;
 	AABB bbox;
+	bool dirty = false; // set whenever the triangles change, cleared once the main loop has noticed it
+	uint64_t sourceHash = 0; // hash of the .obj file the triangles are from, 0 if they are not (or have been transformed)
 
 	float det3x3(float3 v0, float3 v1, float3 v2) const {
 		float V = dot(cross(v0, v1), v2);
@@ -639,26 +1135,35 @@ public:
 	}
 
 
+	// the normals are transformed by the inverse transpose of the upper 3x3 of m, so that they stay perpendicular
+	// to the surface under non-uniform scaling
+	static float3x3 normalMatrix(const float4x4& m) {
+		return transpose(inverse(float3x3{ m[0].xyz(), m[1].xyz(), m[2].xyz() }));
+	}
+	static Triangle transformTriangle(const Triangle& tri, const float4x4& m, const float3x3& normalM) {
+		Triangle result = tri;
+		for (int k = 0; k <= 2; k++) {
+			result.positions[k] = mul(m, float4(tri.positions[k], 1.0f)).xyz();
+			result.normals[k] = normalize(mul(normalM, tri.normals[k]));
+		}
+		return result;
+	}
+
+	// matrix transformation of an object (preCalc() has to be called again afterward)
 	void transform(const float4x4& m) {
-		// ====== implement it if you want =====
-		// matrix transformation of an object	
-		// m is a matrix that transforms an object
-		// implement proper transformation for positions and normals
-		// (hint: you will need to have float4 versions of p and n)
+		const float3x3 normalM = normalMatrix(m);
 		for (unsigned int i = 0; i < this->triangles.size(); i++) {
-			for (int k = 0; k <= 2; k++) {
-				const float3 &p = this->triangles[i].positions[k];
-				const float3 &n = this->triangles[i].normals[k];
-				// not doing anything right now
-			}
+			this->triangles[i] = transformTriangle(this->triangles[i], m, normalM);
 		}
+		sourceHash = 0;
+		dirty = true;
 	}
 
-	float4 ndcToScreen(const float4 ndcPos) const {
+	float4 ndcToScreen(const float4 ndcPos, const Image& target) const {
 		// convert from [-1, 1] to [0, 1]
 		float4 screenPos;
-		screenPos.x = linalg::lerp(0.0f, globalWidth, (ndcPos.x + 1.0f) * 0.5f);
-		screenPos.y = linalg::lerp(0.0f, globalHeight, (ndcPos.y + 1.0f) * 0.5f);
+		screenPos.x = linalg::lerp(0.0f, float(target.width), (ndcPos.x + 1.0f) * 0.5f);
+		screenPos.y = linalg::lerp(0.0f, float(target.height), (ndcPos.y + 1.0f) * 0.5f);
 		screenPos.z = linalg::lerp(globalDepthMin, globalDepthMax, (ndcPos.z + 1.0f) * 0.5f);
 		screenPos.w = ndcPos.w;
 		return screenPos;
@@ -703,7 +1208,7 @@ public:
 		return { alpha, beta, gamma };
 	}
 
-	void rasterizeTriangle(const Triangle& tri, const float4x4& plm) const {
+	void rasterizeTriangle(const Triangle& tri, const float4x4& plm, Image& target) const {
 		// ====== implement it in A2 ======
 		// rasterization of a triangle
 		// "plm" should be a matrix that contains perspective projection and the camera matrix
@@ -724,7 +1229,7 @@ public:
 			if (std::abs(clipPos[k].w) < edgeEps) continue; // avoid division by zero
 
 			ndcPos[k] = { clipPos[k].x / clipPos[k].w, clipPos[k].y / clipPos[k].w, clipPos[k].z / clipPos[k].w, clipPos[k].w };
-			scrnPos[k] = ndcToScreen(ndcPos[k]);
+			scrnPos[k] = ndcToScreen(ndcPos[k], target);
 			
 			wRecip[k] = 1.0f / clipPos[k].w;
 
@@ -737,9 +1242,9 @@ public:
 
 		// Get triangle bounding box
 		int minx = std::max(0, static_cast<int>(std::min(scrnPos[0].x, std::min(scrnPos[1].x, scrnPos[2].x))));
-		int maxx = std::min(globalWidth - 1, static_cast<int>(std::max(scrnPos[0].x, std::max(scrnPos[1].x, scrnPos[2].x))));
+		int maxx = std::min(target.width - 1, static_cast<int>(std::max(scrnPos[0].x, std::max(scrnPos[1].x, scrnPos[2].x))));
 		int miny = std::max(0, static_cast<int>(std::min(scrnPos[0].y, std::min(scrnPos[1].y, scrnPos[2].y))));
-		int maxy = std::min(globalHeight - 1, static_cast<int>(std::max(scrnPos[0].y, std::max(scrnPos[1].y, scrnPos[2].y))));
+		int maxy = std::min(target.height - 1, static_cast<int>(std::max(scrnPos[0].y, std::max(scrnPos[1].y, scrnPos[2].y))));
 
 		HitInfo trinfo;
 		trinfo.material = &materials[tri.idMaterial];
@@ -789,7 +1294,7 @@ public:
 					// Perspective-correct interpolation
 				float depth = bary_p.x * scrnPos[0].z + bary_p.y * scrnPos[1].z + bary_p.z * scrnPos[2].z;
 
-				if (FrameBuffer.valid(i, j) && depth < FrameBuffer.depth(i, j)) {
+				if (target.valid(i, j) && depth < target.depth(i, j)) {
 					float2 texcoord = (
 						bary_p.x * tri.texcoords[0] +
 						bary_p.y * tri.texcoords[1] +
@@ -798,8 +1303,8 @@ public:
 
 					trinfo.T = texcoord;
 
-					FrameBuffer.pixel(i, j) = shade(trinfo, float3(1.0f));
-					FrameBuffer.depth(i, j) = depth;
+					target.pixel(i, j) = shade(trinfo, float3(1.0f));
+					target.depth(i, j) = depth;
 
 				}
 				//FrameBuffer.pixel(i, j) = shade(trinfo, float3(1.0f));
@@ -814,7 +1319,15 @@ public:
 		// ray-triangle intersection
 		// fill in "result" when there is an intersection
 		// return true/false if there is an intersection or not
+		float t, beta, gamma;
+		if (!intersectTriangle(ray, tri, tMin, tMax, t, beta, gamma)) return false;
+		fillHitInfo(result, ray, tri, t, beta, gamma);
+		return true;
+	}
 
+	// the intersection test of raytraceTriangle without the hit attributes
+	// (the BVH only computes those for the closest hit, see fillHitInfo)
+	bool intersectTriangle(const Ray& ray, const Triangle& tri, float tMin, float tMax, float& t, float& beta, float& gamma) const {
 		// Cramer's Rule
 		float3 A_B = tri.positions[0] - tri.positions[1];
 		float3 A_C = tri.positions[0] - tri.positions[2];
@@ -831,16 +1344,47 @@ public:
 		float Dgamma = det3x3(A_B, A_O, ray.d);
 		float Dt = det3x3(A_B, A_C, A_O);
 
-		float beta = Dbeta / D;
-		float gamma = Dgamma / D;
+		beta = Dbeta / D;
+		gamma = Dgamma / D;
 		float alpha = 1.0f - beta - gamma;
-		float t = Dt / D;
+		t = Dt / D;
 
 		float3 barycentric_coords = { alpha, beta, gamma };
-		if (!validIntersection(t, tMin, tMax, barycentric_coords)) {
-			return false;
+		return validIntersection(t, tMin, tMax, barycentric_coords);
+	}
+
+	// yes/no version of raytraceTriangle for shadow rays (no hit attributes are computed)
+	bool occludeTriangle(const Ray& ray, const Triangle& tri, float tMin, float tMax, bool cullBackFaces) const {
+		float3 A_B = tri.positions[0] - tri.positions[1];
+		float3 A_C = tri.positions[0] - tri.positions[2];
+		float3 A_O = tri.positions[0] - ray.o;
+
+		float3 Norm = cross(A_B, A_C);
+		float NdotRayDir = dot(Norm, ray.d);
+		if (fabs(NdotRayDir) < Epsilon) return false;	// Ray parallel to triangle
+
+		if (cullBackFaces) {
+			// the front side is the one the shading normals point to
+			const float facing = dot(Norm, tri.normals[0] + tri.normals[1] + tri.normals[2]);
+			if (((facing < 0.0f) ? -NdotRayDir : NdotRayDir) > 0.0f) return false;
 		}
 
+		float D = NdotRayDir;
+		float beta = det3x3(A_O, A_C, ray.d) / D;
+		if ((beta <= 0) || (beta >= 1)) return false;
+		float gamma = det3x3(A_B, A_O, ray.d) / D;
+		if ((gamma <= 0) || (gamma >= 1)) return false;
+		float alpha = 1.0f - beta - gamma;
+		float t = det3x3(A_B, A_C, A_O) / D;
+
+		return validIntersection(t, tMin, tMax, float3(alpha, beta, gamma));
+	}
+
+	// fill in "result" for a hit found by intersectTriangle or the packet tracer (same attributes as raytraceTriangle)
+	void fillHitInfo(HitInfo& result, const Ray& ray, const Triangle& tri, const float t, const float beta, const float gamma) const {
+		const float3 barycentric_coords = { 1.0f - beta - gamma, beta, gamma };
+		const float3 Norm = cross(tri.positions[0] - tri.positions[1], tri.positions[0] - tri.positions[2]);
+
 		result.material = &materials[tri.idMaterial];
 		result.t = t;
 		result.P = ray.o + t * ray.d;
@@ -851,11 +1395,99 @@ public:
 		if (dot(Norm, N) < 0.0f) {
 			result.N_g = -result.N_g;
 		}
+		result.T = barycentric_coords.x * tri.texcoords[0] + barycentric_coords.y * tri.texcoords[1] + barycentric_coords.z * tri.texcoords[2];
+	}
 
-		float2 T = barycentric_coords.x * tri.texcoords[0] + barycentric_coords.y * tri.texcoords[1] + barycentric_coords.z * tri.texcoords[2];
-		result.T = T;
-		return true;
+#ifdef CS488_SSE
+	// intersect four rays with one triangle (the same arithmetic as raytraceTriangle, one ray per SSE lane)
+	// returns a lane mask of the active rays that hit it between tMin and tMax
+	static __m128 intersectTrianglePacket(const Triangle& tri, const RayPacket& packet, const __m128 active, const float tMin, const __m128 tMax,
+		__m128& t, __m128& beta, __m128& gamma, __m128& D) {
+		const float3 A_B = tri.positions[0] - tri.positions[1];
+		const float3 A_C = tri.positions[0] - tri.positions[2];
+		const float3 Norm = cross(A_B, A_C);
+
+		const __m128 aox = _mm_sub_ps(_mm_set1_ps(tri.positions[0].x), packet.ox);
+		const __m128 aoy = _mm_sub_ps(_mm_set1_ps(tri.positions[0].y), packet.oy);
+		const __m128 aoz = _mm_sub_ps(_mm_set1_ps(tri.positions[0].z), packet.oz);
+		const __m128 abx = _mm_set1_ps(A_B.x), aby = _mm_set1_ps(A_B.y), abz = _mm_set1_ps(A_B.z);
+		const __m128 acx = _mm_set1_ps(A_C.x), acy = _mm_set1_ps(A_C.y), acz = _mm_set1_ps(A_C.z);
+		const __m128 nx = _mm_set1_ps(Norm.x), ny = _mm_set1_ps(Norm.y), nz = _mm_set1_ps(Norm.z);
+
+		auto dot3 = [](__m128 ax, __m128 ay, __m128 az, __m128 bx, __m128 by, __m128 bz) -> __m128 {
+			return _mm_add_ps(_mm_add_ps(_mm_mul_ps(ax, bx), _mm_mul_ps(ay, by)), _mm_mul_ps(az, bz));
+		};
+
+		// D = det(A_B, A_C, d) is also the (unnormalized) normal dotted with the ray direction
+		D = dot3(nx, ny, nz, packet.dx, packet.dy, packet.dz);
+		const __m128 absD = _mm_andnot_ps(_mm_set1_ps(-0.0f), D);
+		__m128 valid = _mm_and_ps(active, _mm_cmpge_ps(absD, _mm_set1_ps(Epsilon)));
+		if (_mm_movemask_ps(valid) == 0) return valid;
+
+		// Dbeta = det(A_O, A_C, d)
+		const __m128 bcx = _mm_sub_ps(_mm_mul_ps(aoy, acz), _mm_mul_ps(aoz, acy));
+		const __m128 bcy = _mm_sub_ps(_mm_mul_ps(aoz, acx), _mm_mul_ps(aox, acz));
+		const __m128 bcz = _mm_sub_ps(_mm_mul_ps(aox, acy), _mm_mul_ps(aoy, acx));
+		const __m128 Dbeta = dot3(bcx, bcy, bcz, packet.dx, packet.dy, packet.dz);
+
+		// Dgamma = det(A_B, A_O, d)
+		const __m128 gcx = _mm_sub_ps(_mm_mul_ps(aby, aoz), _mm_mul_ps(abz, aoy));
+		const __m128 gcy = _mm_sub_ps(_mm_mul_ps(abz, aox), _mm_mul_ps(abx, aoz));
+		const __m128 gcz = _mm_sub_ps(_mm_mul_ps(abx, aoy), _mm_mul_ps(aby, aox));
+		const __m128 Dgamma = dot3(gcx, gcy, gcz, packet.dx, packet.dy, packet.dz);
+
+		// Dt = det(A_B, A_C, A_O)
+		const __m128 Dt = dot3(nx, ny, nz, aox, aoy, aoz);
+
+		beta = _mm_div_ps(Dbeta, D);
+		gamma = _mm_div_ps(Dgamma, D);
+		const __m128 alpha = _mm_sub_ps(_mm_sub_ps(_mm_set1_ps(1.0f), beta), gamma);
+		t = _mm_div_ps(Dt, D);
+
+		const __m128 zero = _mm_setzero_ps();
+		const __m128 one = _mm_set1_ps(1.0f);
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(t, tMax), _mm_cmpgt_ps(t, _mm_set1_ps(tMin))));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(alpha, one), _mm_cmpgt_ps(alpha, zero)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(beta, one), _mm_cmpgt_ps(beta, zero)));
+		valid = _mm_and_ps(valid, _mm_and_ps(_mm_cmplt_ps(gamma, one), _mm_cmpgt_ps(gamma, zero)));
+		return valid;
+	}
+
+	// intersect four rays with one triangle and update the closest hits of the active rays
+	void raytraceTrianglePacket(PacketHit& hit, const RayPacket& packet, const int triId, const int objectId, const __m128 active, const float tMin) const {
+		__m128 t, beta, gamma, D;
+		const int mask = _mm_movemask_ps(intersectTrianglePacket(triangles[triId], packet, active, tMin, _mm_load_ps(hit.t), t, beta, gamma, D));
+		if (mask == 0) return;
+
+		alignas(16) float tv[PacketSize], bv[PacketSize], gv[PacketSize];
+		_mm_store_ps(tv, t);
+		_mm_store_ps(bv, beta);
+		_mm_store_ps(gv, gamma);
+		for (int k = 0; k < PacketSize; k++) {
+			if (mask & (1 << k)) {
+				hit.t[k] = tv[k];
+				hit.object[k] = objectId;
+				hit.triangle[k] = triId;
+				hit.beta[k] = bv[k];
+				hit.gamma[k] = gv[k];
+			}
+		}
+	}
+
+	// packet version of occludeTriangle: returns a lane mask of the active rays that are blocked by the triangle
+	__m128 occludeTrianglePacket(const RayPacket& packet, const Triangle& tri, const __m128 active, const float tMin, const __m128 tMax, const bool cullBackFaces) const {
+		__m128 t, beta, gamma, D;
+		__m128 blocked = intersectTrianglePacket(tri, packet, active, tMin, tMax, t, beta, gamma, D);
+		if (cullBackFaces && (_mm_movemask_ps(blocked) != 0)) {
+			// the front side is the one the shading normals point to
+			const float3 Norm = cross(tri.positions[0] - tri.positions[1], tri.positions[0] - tri.positions[2]);
+			const float facing = dot(Norm, tri.normals[0] + tri.normals[1] + tri.normals[2]);
+			const __m128 NdotRayDir = (facing < 0.0f) ? _mm_sub_ps(_mm_setzero_ps(), D) : D;
+			blocked = _mm_andnot_ps(_mm_cmpgt_ps(NdotRayDir, _mm_setzero_ps()), blocked);
+		}
+		return blocked;
 	}
+#endif
 
 
 	// some precalculation for bounding boxes (you do not need to change it)
@@ -955,6 +1587,7 @@ public:
 			}
 		}
 		printf("Loaded \"%s\" with %d triangles.\n", filename, int(triangles.size()));
+		sourceHash = globalBVHCacheDir.empty() ? 0 : hashFile(filename);
 
 		delete[] vertices;
 		delete[] normals;
@@ -1357,7 +1990,41 @@ private:
 
 
 
+// extra threads that the BVH builds may still start (set by Scene::buildBVHs, 0 builds on the calling thread)
+// subtrees, chunks of the top-level nodes and meshes all draw from it, so the builds never use more than
+// globalNumThreads threads in total
+static std::atomic<int> globalBVHBuildThreads(0);
+
+static bool acquireBVHBuildThread() {
+	int available = globalBVHBuildThreads.load();
+	while (available > 0) {
+		if (globalBVHBuildThreads.compare_exchange_weak(available, available - 1)) return true;
+	}
+	return false;
+}
+
+// split [0, n) into up to 1 + (the threads we can get) chunks of at least minChunk elements
+static int acquireBVHChunks(const int n, const int minChunk) {
+	int chunks = 1;
+	while ((n / (chunks + 1) >= minChunk) && acquireBVHBuildThread()) chunks++;
+	return chunks;
+}
+
+// runs func(chunk, begin, end) for every chunk (the calling thread takes chunk 0)
+// the threads are given back with globalBVHBuildThreads += chunks - 1 once they are no longer needed
+template <typename Func>
+static void runBVHChunks(const int n, const int chunks, const Func& func) {
+	std::vector<std::thread> threads;
+	for (int c = 1; c < chunks; c++) {
+		threads.push_back(std::thread([&func, n, chunks, c]() { func(c, int((long long)n * c / chunks), int((long long)n * (c + 1) / chunks)); }));
+	}
+	func(0, 0, int((long long)n / chunks));
+	for (std::thread& thread : threads) thread.join();
+}
+
+
 // BVH node (for A1 extra)
+// the builders work on these, and BVH::flatten then turns them into FlatBVHNodes for traversal
 class BVHNode {
 public:
 	bool isLeaf;
@@ -1367,22 +2034,94 @@ public:
 	AABB bbox;
 };
 
+// compact BVH node for traversal: 32 bytes, two per cache line
+// the nodes are in depth-first order, so the left child of an interior node is the next node and
+// "offset" is the right child; a leaf (count > 0) holds the triangles primIndices[offset, offset + count)
+struct alignas(32) FlatBVHNode {
+	AABB bbox;
+	int offset;
+	int count;
+
+	bool isLeaf() const { return count > 0; }
+};
+static_assert(sizeof(FlatBVHNode) == 32, "FlatBVHNode should be 32 bytes");
+
+// 4-wide BVH node made by collapsing the binary tree (see BVH::buildWide): 128 bytes, two cache lines
+// the boxes of the four children are stored as SoA (bounds[0..2] = min x/y/z, bounds[3..5] = max x/y/z),
+// so one SSE slab test checks all of them
+struct alignas(64) WideBVHNode {
+	float bounds[6][4];
+	int child[4]; // interior child: index of its node, leaf child: offset into primIndices
+	int count[4]; // leaf child: number of triangles, 0: interior child, -1: empty slot (its box is empty)
+};
+static_assert(sizeof(WideBVHNode) == 128, "WideBVHNode should be 128 bytes");
+
+
+// the last few triangles that a ray has tested, so that the references that spatial splits (BVH_SBVH) put
+// into several leaves are only tested once (the traversals use it for trees that have such references)
+struct TriangleMailbox {
+	static constexpr int Size = 8;
+	int prims[Size] = { -1, -1, -1, -1, -1, -1, -1, -1 };
+	int next = 0;
+
+	// true if prim has been tested, records it otherwise
+	bool visited(const int prim) {
+		for (int k = 0; k < Size; k++) {
+			if (prims[k] == prim) return true;
+		}
+		prims[next] = prim;
+		next = (next + 1) % Size;
+		return false;
+	}
+};
+
 
 // ====== implement it in A1 extra ======
 // fill in the missing parts
 class BVH {
 public:
 	const TriangleMesh* triangleMesh = nullptr;
-	BVHNode* node = nullptr;
+	BVHNode* node = nullptr; // only during the build
+	FlatBVHNode* flatNodes = nullptr; // nodeNum nodes, aligned to 64 bytes
+	WideBVHNode* wideNodes = nullptr; // wideNodeNum nodes when globalWideBVH was set for the build
+	int wideNodeNum = 0;
+	int wideDepth = 0;
+	int* primIndices = nullptr; // primNum triangle indices, referenced by the leaves
+	int primNum = 0;
+	enumBVHBuilder builder = BVH_MEDIAN;
+
+	static constexpr int BVHBinNum = 16;
+	static constexpr int BVHTaskMin = 4096; // subtrees with at least this many triangles may be built by another thread
+	static constexpr int BVHChunkMin = 32768; // binning and partitioning are split into chunks of at least this many triangles
 
 	const float costBBox = 1.0f;
 	const float costTri = 1.0f;
 
+	static constexpr int BVHRefitChunkMin = 16384; // nodes per refit thread
+	static constexpr uint32_t BVHCacheVersion = 1; // increase whenever the cache file layout or the builders change
+	static constexpr float SBVHDuplicationMax = 4.0f; // limits globalSBVHDuplication
+	static constexpr float SBVHOverlapMin = 1e-5f; // spatial splits are tried where the object split overlaps by this much of the root area
+
 	int leafNum = 0;
 	int nodeNum = 0;
+	int maxDepth = 0;
+	float buildTime = 0.0f; // ms
+	float refitTime = 0.0f; // ms, of the last refit
+	float builtSAHCost = 0.0f; // sahCost() right after the build, the reference for the refits
+	int builtTriangleNum = 0;
 
 	BVH() {}
-	void build(const TriangleMesh* mesh);
+	void build(const TriangleMesh* mesh, const enumBVHBuilder bvhBuilder = globalBVHBuilder, const bool verbose = true);
+	void release();
+
+	// fits the boxes of the tree to the moved triangles of mesh (whose preCalc() has been called), bottom-up in O(n)
+	// and with the subtrees on separate threads, keeping the topology. returns false if the tree should be rebuilt:
+	// the triangles were added or removed, or the refitted tree has become too slow (see globalBVHRefitThreshold)
+	bool refit(const TriangleMesh* mesh);
+
+	// expected cost of a ray under the surface area heuristic (to compare the builders)
+	float sahCost() const;
+	size_t memoryUsage() const { return nodeNum * sizeof(FlatBVHNode) + primNum * sizeof(int); }
 
 	bool intersect(HitInfo& result, const Ray& ray, float tMin = 0.0f, float tMax = FLT_MAX) const {
 		bool hit = false;
@@ -1390,7 +2129,11 @@ public:
 		result.t = FLT_MAX;
 
 		// bvh
-		if (this->node[0].bbox.intersect(tempMinHit, ray)) {
+#ifdef CS488_SSE
+		if (wideNodes && globalWideBVH) return intersectWide(result, ray, tMin, tMax);
+#endif
+		if (maxDepth < TraversalStackSize) return intersectIterative(result, ray, tMin, tMax);
+		if ((nodeNum > 0) && this->flatNodes[0].bbox.intersect(tempMinHit, ray)) {
 			hit = traverse(result, ray, 0, tMin, tMax);
 		}
 		if (result.t != FLT_MAX) hit = true;
@@ -1399,9 +2142,121 @@ public:
 	}
 	bool traverse(HitInfo& result, const Ray& ray, int node_id, float tMin, float tMax) const;
 
+	// closest hit with an explicit stack (for trees up to TraversalStackSize deep, traverse() otherwise)
+	// the near child is visited first, the far one is pushed with its entry distance, and the ray is
+	// clipped to the closest hit so far, so that boxes and triangles behind it are skipped
+	// the hit attributes are only computed for the final hit
+	static constexpr int TraversalStackSize = 64;
+	bool intersectIterative(HitInfo& result, const Ray& ray, float tMin, float tMax) const;
+
+	// spatial splits have put some triangles into several leaves
+	bool hasDuplicates() const { return primNum > builtTriangleNum; }
+
+	// any-hit query for shadow rays: stops at the first triangle between tMin and tMax
+	bool occluded(const Ray& ray, float tMin, float tMax, bool cullBackFaces = false) const {
+#ifdef CS488_SSE
+		if (wideNodes && globalWideBVH) return occludedWide(ray, tMin, tMax, cullBackFaces);
+#endif
+		float tNear;
+		if ((nodeNum == 0) || !this->flatNodes[0].bbox.intersect(tNear, ray) || (tNear > tMax)) return false;
+		TriangleMailbox mailbox;
+		return occludedNode(ray, 0, tMin, tMax, cullBackFaces, hasDuplicates() ? &mailbox : nullptr);
+	}
+	bool occludedNode(const Ray& ray, int node_id, float tMin, float tMax, bool cullBackFaces, TriangleMailbox* mailbox = nullptr) const;
+
+#ifdef CS488_SSE
+	// packet traversal: all rays share one walk over the tree, and a subtree is skipped
+	// only when none of the active rays can hit it
+	static constexpr int PacketStackSize = 64;
+	bool supportsPackets() const { return maxDepth < PacketStackSize; }
+	void intersectPacket(PacketHit& hit, const RayPacket& packet, const int objectId, const float tMin = 0.0f) const;
+
+	// any-hit packet query: returns a lane mask of the active rays that are blocked between tMin and tMax
+	__m128 occludedPacket(const RayPacket& packet, __m128 active, const float tMin, const __m128 tMax, const bool cullBackFaces = false) const;
+
+	// single rays through the 4-wide BVH: the children are tested with one SSE slab test (with the inverse
+	// direction and the near/far planes picked by its signs once per ray) and visited nearest first
+	static constexpr int WideStackSize = 256;
+	void buildWide();
+	bool intersectWide(HitInfo& result, const Ray& ray, float tMin, float tMax) const;
+	bool occludedWide(const Ray& ray, float tMin, float tMax, bool cullBackFaces) const;
+#endif
+
 private:
 	void sortAxis(int* obj_index, const char axis, const int li, const int ri) const;
-	int splitBVH(int* obj_index, const int obj_num, const AABB& bbox);
+	// shared by the tasks of one build
+	struct BuildState {
+		std::atomic<int> nodeNum{ 0 };
+		std::atomic<int> leafNum{ 0 };
+		std::atomic<int> duplicateBudget{ 0 }; // BVH_SBVH: references that spatial splits may still add
+		float rootArea = 0.0f;
+
+		// takes one reference from the budget, if there is any left (the node array is sized for the budget)
+		bool reserveDuplicate() {
+			int budget = duplicateBudget.load();
+			while (budget > 0) {
+				if (duplicateBudget.compare_exchange_weak(budget, budget - 1)) return true;
+			}
+			return false;
+		}
+	};
+	// globalSBVHDuplication within [0, SBVHDuplicationMax]
+	static float duplicationFactor() { return fminf(fmaxf(globalSBVHDuplication, 0.0f), SBVHDuplicationMax); }
+	int splitBVH(BuildState& state, int* obj_index, const int obj_num, const AABB& bbox);
+	int depth(const int node_id) const;
+	int subtreeEnd(const int node_id) const;
+	void refitNode(const int node_id);
+
+	// the depth-first FlatBVHNode layout of the build nodes, which are freed
+	void flatten();
+	int flattenNode(const int node_id, int& nextNode, int& nextPrim);
+	void releaseBuildNodes();
+	unsigned char* flatNodeStorage = nullptr;
+	unsigned char* wideNodeStorage = nullptr;
+
+	// cache files: a 64-byte header, the flat nodes and the triangle indices, mapped as they are (flatNodes and
+	// primIndices then point into the mapping, which is private, so refits do not change the file)
+	struct CacheHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t nodeSize;
+		uint64_t key;
+		int32_t triangleNum, nodeNum, primNum, leafNum, maxDepth, builder;
+		float sahCost;
+		char padding[12];
+	};
+	static_assert(sizeof(CacheHeader) == 64, "the nodes of a cache file should start at 64 bytes");
+	void* cacheBase = nullptr; // the mapping (or a copy where there is no mmap)
+	size_t cacheSize = 0;
+	uint64_t cacheKey(const TriangleMesh* mesh, const enumBVHBuilder bvhBuilder) const;
+	std::string cachePath(const uint64_t key) const;
+	bool loadCache(const TriangleMesh* mesh, const uint64_t key);
+	static bool validCacheTree(const CacheHeader& header, const FlatBVHNode* nodes, const int* prims);
+	void saveCache(const uint64_t key) const;
+	void releaseCache();
+	int collapseWide(const int node_id, std::vector<WideBVHNode>& wide, const int depth);
+
+	// each one fills sorted_obj_index with obj_index in the split order, the boxes of the two sides,
+	// and returns the index of the last triangle on the left side
+	int splitMedian(int* obj_index, const int obj_num, const AABB& bbox, int* sorted_obj_index, AABB& bestbboxL, AABB& bestbboxR) const;
+	int splitSAH(int* obj_index, const int obj_num, const AABB& bbox, int* sorted_obj_index, AABB& bestbboxL, AABB& bestbboxR) const;
+	int splitBinnedSAH(int* obj_index, const int obj_num, const AABB& bbox, int* sorted_obj_index, AABB& bestbboxL, AABB& bestbboxR) const;
+
+	// linear BVH: the triangles are sorted by the Morton codes of their centers, and each node splits
+	// its range where the highest bit of the codes changes
+	void buildLBVH(BuildState& state, int* obj_index, const int obj_num);
+	int emitLBVH(BuildState& state, const uint64_t* codes, const int* sorted, const int first, const int last, AABB& bbox);
+	void optimizeTreelets(const int node_id, std::vector<float>& costs);
+	void restructureTreelet(const int node_id, std::vector<float>& costs);
+
+	// spatial split BVH (Stich et al. 2009): each node takes the better of a binned SAH object split and a
+	// spatial split, which cuts the references that straddle its plane in two (clipping the triangle to each side)
+	struct SBVHReference {
+		int prim;
+		AABB bbox; // the part of the triangle that this reference covers
+	};
+	int splitSBVH(BuildState& state, std::vector<SBVHReference>& refs, const AABB& bbox);
+	int makeLeaf(BuildState& state, const int* prims, const int num, const AABB& bbox);
 
 };
 
@@ -1441,13 +2296,9 @@ void BVH::sortAxis(int* obj_index, const char axis, const int li, const int ri)
 }
 
 
-//#define SAHBVH // use this in once you have SAH-BVH
-int BVH::splitBVH(int* obj_index, const int obj_num, const AABB& bbox) {
-	// ====== extend it in A1 extra ======
-#ifndef SAHBVH
+int BVH::splitMedian(int* obj_index, const int obj_num, const AABB& bbox, int* sorted_obj_index, AABB& bestbboxL, AABB& bestbboxR) const {
 	int bestAxis, bestIndex;
-	AABB bboxL, bboxR, bestbboxL, bestbboxR;
-	int* sorted_obj_index  = new int[obj_num];
+	AABB bboxL, bboxR;
 
 	// split along the largest axis
 	bestAxis = bbox.getLargestAxis();
@@ -1479,12 +2330,16 @@ int BVH::splitBVH(int* obj_index, const int obj_num, const AABB& bbox) {
 
 	bestbboxL = bboxL;
 	bestbboxR = bboxR;
-#else
+
+	return bestIndex;
+}
+
+
+int BVH::splitSAH(int* obj_index, const int obj_num, const AABB& bbox, int* sorted_obj_index, AABB& bestbboxL, AABB& bestbboxR) const {
 	// implement SAH-BVH here
 	int bestAxis = 0, bestIndex = 0;
 	float bestCost = FLT_MAX;
-	AABB bboxL, bboxR, bestbboxL, bestbboxR;
-	int* sorted_obj_index = new int[obj_num];
+	AABB bboxL, bboxR;
 
 	// Evaluate along all three axes
 	for (int axis = 0; axis < 3; ++axis) {
@@ -1537,55 +2392,165 @@ int BVH::splitBVH(int* obj_index, const int obj_num, const AABB& bbox) {
 	float original_cost = obj_num * costTri;
 	// If SAH cost is not better than simple case
 	if (original_cost <= bestCost) {
-		bestAxis = bbox.getLargestAxis();
-		this->sortAxis(obj_index, bestAxis, 0, obj_num - 1);
-		for (int i = 0; i < obj_num; ++i) {
-			sorted_obj_index[i] = obj_index[i];
-		}
+		return splitMedian(obj_index, obj_num, bbox, sorted_obj_index, bestbboxL, bestbboxR);
+	}
 
-		// split in the middle
-		bestIndex = obj_num / 2 - 1;
+	return bestIndex;
+}
 
-		bboxL.reset();
-		for (int i = 0; i <= bestIndex; ++i) {
-			const Triangle& tri = triangleMesh->triangles[obj_index[i]];
-			bboxL.fit(tri.positions[0]);
-			bboxL.fit(tri.positions[1]);
-			bboxL.fit(tri.positions[2]);
+
+int BVH::splitBinnedSAH(int* obj_index, const int obj_num, const AABB& bbox, int* sorted_obj_index, AABB& bestbboxL, AABB& bestbboxR) const {
+	// the triangles are put into BVHBinNum bins along each axis by their centers, and only the boundaries
+	// between the bins are evaluated, so each node takes O(obj_num + BVHBinNum) instead of O(obj_num^2)
+	// (large nodes are binned and partitioned in chunks on several threads, which gives the same tree)
+	const int chunks = acquireBVHChunks(obj_num, BVHChunkMin);
+
+	std::vector<AABB> chunkCenters(chunks);
+	runBVHChunks(obj_num, chunks, [&](const int c, const int begin, const int end) {
+		for (int i = begin; i < end; ++i) {
+			chunkCenters[c].fit(triangleMesh->triangles[obj_index[i]].center);
 		}
+	});
+	AABB centers;
+	for (const AABB& box : chunkCenters) centers.fit(box);
+	const float3 centerMin = centers.get_minp();
+	const float3 centerSize = centers.get_size();
+
+	struct Bin {
+		AABB bbox;
+		int count = 0;
+	};
+	auto binIndex = [&](const Triangle& tri, const int axis) {
+		const int b = int((tri.center[axis] - centerMin[axis]) * (BVHBinNum / centerSize[axis]));
+		return std::min(b, BVHBinNum - 1);
+	};
 
-		bboxR.reset();
-		for (int i = bestIndex + 1; i < obj_num; ++i) {
+	// the bins of all three axes in one pass
+	std::vector<Bin> chunkBins(chunks * 3 * BVHBinNum);
+	runBVHChunks(obj_num, chunks, [&](const int c, const int begin, const int end) {
+		Bin* bins = &chunkBins[c * 3 * BVHBinNum];
+		for (int i = begin; i < end; ++i) {
 			const Triangle& tri = triangleMesh->triangles[obj_index[i]];
-			bboxR.fit(tri.positions[0]);
-			bboxR.fit(tri.positions[1]);
-			bboxR.fit(tri.positions[2]);
+			for (int axis = 0; axis < 3; ++axis) {
+				if (centerSize[axis] <= 0.0f) continue;
+				Bin& bin = bins[axis * BVHBinNum + binIndex(tri, axis)];
+				bin.count++;
+				bin.bbox.fit(tri.positions[0]);
+				bin.bbox.fit(tri.positions[1]);
+				bin.bbox.fit(tri.positions[2]);
+			}
+		}
+	});
+	Bin bins[3 * BVHBinNum];
+	for (int c = 0; c < chunks; ++c) {
+		for (int b = 0; b < 3 * BVHBinNum; ++b) {
+			bins[b].bbox.fit(chunkBins[c * 3 * BVHBinNum + b].bbox);
+			bins[b].count += chunkBins[c * 3 * BVHBinNum + b].count;
+		}
+	}
+
+	int bestAxis = -1, bestBin = 0;
+	float bestCost = FLT_MAX;
+	const float SA_parent = bbox.area();
+	for (int axis = 0; axis < 3; ++axis) {
+		if (centerSize[axis] <= 0.0f) continue;
+		const Bin* axisBins = &bins[axis * BVHBinNum];
+
+		// sweep from the right for the right sides, then from the left
+		float areaR[BVHBinNum];
+		int countR[BVHBinNum];
+		AABB bboxR;
+		int count = 0;
+		for (int b = BVHBinNum - 1; b > 0; --b) {
+			bboxR.fit(axisBins[b].bbox);
+			count += axisBins[b].count;
+			areaR[b] = bboxR.area();
+			countR[b] = count;
 		}
 
-		bestbboxL = bboxL;
-		bestbboxR = bboxR;
+		AABB bboxL;
+		count = 0;
+		for (int b = 0; b < BVHBinNum - 1; ++b) {
+			bboxL.fit(axisBins[b].bbox);
+			count += axisBins[b].count;
+			if ((count == 0) || (countR[b + 1] == 0)) continue;
+
+			const float cost = costBBox + (bboxL.area() / SA_parent) * count * costTri +
+				(areaR[b + 1] / SA_parent) * countR[b + 1] * costTri;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
 	}
 
-#endif
+	// all the centers in one bin, or no split is better than the simple case
+	if ((bestAxis < 0) || (obj_num * costTri <= bestCost)) {
+		globalBVHBuildThreads += chunks - 1;
+		return splitMedian(obj_index, obj_num, bbox, sorted_obj_index, bestbboxL, bestbboxR);
+	}
 
-	if (obj_num <= 4) {
-		delete[] sorted_obj_index;
+	// the boxes of the two sides are the union of their bins
+	bestbboxL.reset();
+	bestbboxR.reset();
+	int numL = 0;
+	for (int b = 0; b < BVHBinNum; ++b) {
+		const Bin& bin = bins[bestAxis * BVHBinNum + b];
+		if (b <= bestBin) numL += bin.count;
+		((b <= bestBin) ? bestbboxL : bestbboxR).fit(bin.bbox);
+	}
 
-		this->nodeNum++;
-		this->node[this->nodeNum - 1].bbox = bbox;
-		this->node[this->nodeNum - 1].isLeaf = true;
-		this->node[this->nodeNum - 1].triListNum = obj_num;
-		this->node[this->nodeNum - 1].triList = new int[obj_num];
-		for (int i = 0; i < obj_num; i++) {
-			this->node[this->nodeNum - 1].triList[i] = obj_index[i];
+	// partition (keeping the order within each side): count the left side of each chunk, then scatter
+	std::vector<int> chunkLeft(chunks + 1, 0);
+	runBVHChunks(obj_num, chunks, [&](const int c, const int begin, const int end) {
+		int count = 0;
+		for (int i = begin; i < end; ++i) {
+			if (binIndex(triangleMesh->triangles[obj_index[i]], bestAxis) <= bestBin) count++;
+		}
+		chunkLeft[c + 1] = count;
+	});
+	for (int c = 0; c < chunks; ++c) chunkLeft[c + 1] += chunkLeft[c];
+	runBVHChunks(obj_num, chunks, [&](const int c, const int begin, const int end) {
+		int left = chunkLeft[c];
+		int right = numL + (begin - chunkLeft[c]);
+		for (int i = begin; i < end; ++i) {
+			if (binIndex(triangleMesh->triangles[obj_index[i]], bestAxis) <= bestBin) {
+				sorted_obj_index[left++] = obj_index[i];
+			} else {
+				sorted_obj_index[right++] = obj_index[i];
+			}
 		}
-		int temp_id;
-		temp_id = this->nodeNum - 1;
-		this->leafNum++;
+	});
+	globalBVHBuildThreads += chunks - 1;
 
-		return temp_id;
-	} else {
-		// split obj_index into two 
+	return numL - 1;
+}
+
+
+int BVH::splitBVH(BuildState& state, int* obj_index, const int obj_num, const AABB& bbox) {
+	// ====== extend it in A1 extra ======
+	int bestIndex;
+	AABB bestbboxL, bestbboxR;
+	int* sorted_obj_index = new int[obj_num];
+
+	switch (builder) {
+	case BVH_SAH:
+		bestIndex = splitSAH(obj_index, obj_num, bbox, sorted_obj_index, bestbboxL, bestbboxR);
+		break;
+	case BVH_BINNED_SAH:
+		bestIndex = splitBinnedSAH(obj_index, obj_num, bbox, sorted_obj_index, bestbboxL, bestbboxR);
+		break;
+	default:
+		bestIndex = splitMedian(obj_index, obj_num, bbox, sorted_obj_index, bestbboxL, bestbboxR);
+		break;
+	}
+
+	if (obj_num <= 4) {
+		delete[] sorted_obj_index;
+		return makeLeaf(state, obj_index, obj_num, bbox);
+	} else {
+		// split obj_index into two 
 		int* obj_indexL = new int[bestIndex + 1];
 		int* obj_indexR = new int[obj_num - (bestIndex + 1)];
 		for (int i = 0; i <= bestIndex; ++i) {
@@ -1599,13 +2564,19 @@ int BVH::splitBVH(int* obj_index, const int obj_num, const AABB& bbox) {
 		int obj_numR = obj_num - (bestIndex + 1);
 
 		// recursive call to build a tree
-		this->nodeNum++;
-		int temp_id;
-		temp_id = this->nodeNum - 1;
+		// (a large left subtree becomes a task on another thread if there is one to spare)
+		const int temp_id = state.nodeNum++;
 		this->node[temp_id].bbox = bbox;
 		this->node[temp_id].isLeaf = false;
-		this->node[temp_id].idLeft = splitBVH(obj_indexL, obj_numL, bestbboxL);
-		this->node[temp_id].idRight = splitBVH(obj_indexR, obj_numR, bestbboxR);
+		if ((obj_numL >= BVHTaskMin) && (obj_numR >= BVHTaskMin) && acquireBVHBuildThread()) {
+			std::thread task([&]() { this->node[temp_id].idLeft = splitBVH(state, obj_indexL, obj_numL, bestbboxL); });
+			this->node[temp_id].idRight = splitBVH(state, obj_indexR, obj_numR, bestbboxR);
+			task.join();
+			globalBVHBuildThreads++;
+		} else {
+			this->node[temp_id].idLeft = splitBVH(state, obj_indexL, obj_numL, bestbboxL);
+			this->node[temp_id].idRight = splitBVH(state, obj_indexR, obj_numR, bestbboxR);
+		}
 
 		delete[] obj_indexL;
 		delete[] obj_indexR;
@@ -1615,9 +2586,510 @@ int BVH::splitBVH(int* obj_index, const int obj_num, const AABB& bbox) {
 }
 
 
+int BVH::makeLeaf(BuildState& state, const int* prims, const int num, const AABB& bbox) {
+	const int temp_id = state.nodeNum++;
+	this->node[temp_id].bbox = bbox;
+	this->node[temp_id].isLeaf = true;
+	this->node[temp_id].triListNum = num;
+	this->node[temp_id].triList = new int[num];
+	for (int i = 0; i < num; i++) {
+		this->node[temp_id].triList[i] = prims[i];
+	}
+	state.leafNum++;
+	return temp_id;
+}
+
+
+// the box of the part of tri between the planes lo and hi along axis, within box (the reference that is split)
+static AABB clipTriangleBox(const Triangle& tri, const int axis, const float lo, const float hi, const AABB& box) {
+	AABB clipped;
+	for (int k = 0; k < 3; k++) {
+		const float3& a = tri.positions[k];
+		const float3& b = tri.positions[(k + 1) % 3];
+		if ((a[axis] >= lo) && (a[axis] <= hi)) clipped.fit(a);
+		for (const float plane : { lo, hi }) {
+			// where the edge crosses the plane
+			if ((a[axis] < plane) != (b[axis] < plane)) {
+				float3 p = a + ((plane - a[axis]) / (b[axis] - a[axis])) * (b - a);
+				p[axis] = plane;
+				clipped.fit(p);
+			}
+		}
+	}
+	const float3 minp = linalg::max(clipped.get_minp(), box.get_minp());
+	const float3 maxp = linalg::min(clipped.get_maxp(), box.get_maxp());
+	AABB result;
+	if ((minp.x <= maxp.x) && (minp.y <= maxp.y) && (minp.z <= maxp.z)) {
+		result.fit(minp);
+		result.fit(maxp);
+	}
+	return result;
+}
+
+
+int BVH::splitSBVH(BuildState& state, std::vector<SBVHReference>& refs, const AABB& bbox) {
+	const int ref_num = (int)refs.size();
+	if (ref_num <= 4) {
+		int prims[4];
+		for (int i = 0; i < ref_num; i++) prims[i] = refs[i].prim;
+		return makeLeaf(state, prims, ref_num, bbox);
+	}
+	const float SA_parent = bbox.area();
+
+	// object split: binned SAH over the centers of the triangles, clamped to the reference boxes
+	// (the box centers would not tell apart the two triangles of a quad)
+	auto center = [&](const SBVHReference& ref) { return linalg::clamp(triangleMesh->triangles[ref.prim].center, ref.bbox.get_minp(), ref.bbox.get_maxp()); };
+	AABB centers;
+	for (const SBVHReference& ref : refs) centers.fit(center(ref));
+	const float3 centerMin = centers.get_minp();
+	const float3 centerSize = centers.get_size();
+	auto objectBin = [&](const SBVHReference& ref, const int axis) {
+		return std::max(0, std::min(int((center(ref)[axis] - centerMin[axis]) * (BVHBinNum / centerSize[axis])), BVHBinNum - 1));
+	};
+
+	int objectAxis = -1, objectBinSplit = 0;
+	float objectCost = FLT_MAX;
+	AABB objectBoxL, objectBoxR;
+	for (int axis = 0; axis < 3; ++axis) {
+		if (centerSize[axis] <= 0.0f) continue;
+		AABB bins[BVHBinNum];
+		int counts[BVHBinNum] = {};
+		for (const SBVHReference& ref : refs) {
+			const int b = objectBin(ref, axis);
+			bins[b].fit(ref.bbox);
+			counts[b]++;
+		}
+		AABB boxR[BVHBinNum];
+		int countR[BVHBinNum];
+		AABB right;
+		int count = 0;
+		for (int b = BVHBinNum - 1; b > 0; --b) {
+			right.fit(bins[b]);
+			count += counts[b];
+			boxR[b] = right;
+			countR[b] = count;
+		}
+		AABB left;
+		count = 0;
+		for (int b = 0; b < BVHBinNum - 1; ++b) {
+			left.fit(bins[b]);
+			count += counts[b];
+			if ((count == 0) || (countR[b + 1] == 0)) continue;
+			const float cost = costBBox + (left.area() * count + boxR[b + 1].area() * countR[b + 1]) / SA_parent * costTri;
+			if (cost < objectCost) {
+				objectCost = cost;
+				objectAxis = axis;
+				objectBinSplit = b;
+				objectBoxL = left;
+				objectBoxR = boxR[b + 1];
+			}
+		}
+	}
+
+	// spatial split: BVHBinNum equal slabs of the node box, into which each reference is clipped. it is only worth
+	// trying where the sides of the object split overlap (and while references may still be added)
+	int spatialAxis = -1, spatialCountL = 0, spatialCountR = 0;
+	float spatialCost = FLT_MAX, spatialPlane = 0.0f;
+	AABB spatialBoxL, spatialBoxR;
+	float overlap = 0.0f;
+	if (objectAxis >= 0) {
+		const float3 minp = linalg::max(objectBoxL.get_minp(), objectBoxR.get_minp());
+		const float3 maxp = linalg::min(objectBoxL.get_maxp(), objectBoxR.get_maxp());
+		if ((minp.x <= maxp.x) && (minp.y <= maxp.y) && (minp.z <= maxp.z)) {
+			AABB both;
+			both.fit(minp);
+			both.fit(maxp);
+			overlap = both.area();
+		}
+	}
+	if (((objectAxis < 0) || (overlap > SBVHOverlapMin * state.rootArea)) && (state.duplicateBudget > 0)) {
+		const float3 nodeMin = bbox.get_minp();
+		const float3 nodeSize = bbox.get_size();
+		for (int axis = 0; axis < 3; ++axis) {
+			if (nodeSize[axis] <= 0.0f) continue;
+			const float binWidth = nodeSize[axis] / BVHBinNum;
+			auto spatialBin = [&](const float x) { return std::max(0, std::min(int((x - nodeMin[axis]) / binWidth), BVHBinNum - 1)); };
+			AABB bins[BVHBinNum];
+			int entries[BVHBinNum] = {}, exits[BVHBinNum] = {};
+			for (const SBVHReference& ref : refs) {
+				const int first = spatialBin(ref.bbox.get_minp()[axis]);
+				const int last = std::max(first, spatialBin(ref.bbox.get_maxp()[axis]));
+				entries[first]++;
+				exits[last]++;
+				if (first == last) {
+					bins[first].fit(ref.bbox);
+					continue;
+				}
+				const Triangle& tri = triangleMesh->triangles[ref.prim];
+				for (int b = first; b <= last; b++) {
+					const float lo = (b == first) ? -FLT_MAX : nodeMin[axis] + b * binWidth;
+					const float hi = (b == last) ? FLT_MAX : nodeMin[axis] + (b + 1) * binWidth;
+					bins[b].fit(clipTriangleBox(tri, axis, lo, hi, ref.bbox));
+				}
+			}
+			AABB boxR[BVHBinNum];
+			int countR[BVHBinNum];
+			AABB right;
+			int count = 0;
+			for (int b = BVHBinNum - 1; b > 0; --b) {
+				right.fit(bins[b]);
+				count += exits[b];
+				boxR[b] = right;
+				countR[b] = count;
+			}
+			AABB left;
+			count = 0;
+			for (int b = 0; b < BVHBinNum - 1; ++b) {
+				left.fit(bins[b]);
+				count += entries[b];
+				if ((count == 0) || (countR[b + 1] == 0)) continue;
+				const float cost = costBBox + (left.area() * count + boxR[b + 1].area() * countR[b + 1]) / SA_parent * costTri;
+				if (cost < spatialCost) {
+					spatialCost = cost;
+					spatialAxis = axis;
+					spatialPlane = nodeMin[axis] + (b + 1) * binWidth;
+					spatialBoxL = left;
+					spatialBoxR = boxR[b + 1];
+					spatialCountL = count;
+					spatialCountR = countR[b + 1];
+				}
+			}
+		}
+	}
+
+	std::vector<SBVHReference> refsL, refsR;
+	if ((spatialAxis >= 0) && (spatialCost < objectCost)) {
+		for (const SBVHReference& ref : refs) {
+			if (ref.bbox.get_maxp()[spatialAxis] <= spatialPlane) {
+				refsL.push_back(ref);
+			} else if (ref.bbox.get_minp()[spatialAxis] >= spatialPlane) {
+				refsR.push_back(ref);
+			} else {
+				// a reference that straddles the plane is split, unless it is cheaper to move it whole to one
+				// side ("unsplitting") or there is no budget left
+				const Triangle& tri = triangleMesh->triangles[ref.prim];
+				const AABB boxL = clipTriangleBox(tri, spatialAxis, -FLT_MAX, spatialPlane, ref.bbox);
+				const AABB boxR = clipTriangleBox(tri, spatialAxis, spatialPlane, FLT_MAX, ref.bbox);
+				AABB wholeL = spatialBoxL, wholeR = spatialBoxR;
+				wholeL.fit(ref.bbox);
+				wholeR.fit(ref.bbox);
+				const float costSplit = spatialBoxL.area() * spatialCountL + spatialBoxR.area() * spatialCountR;
+				const float costL = wholeL.area() * spatialCountL + spatialBoxR.area() * (spatialCountR - 1);
+				const float costR = spatialBoxL.area() * (spatialCountL - 1) + wholeR.area() * spatialCountR;
+				const bool hasL = boxL.get_minp().x <= boxL.get_maxp().x, hasR = boxR.get_minp().x <= boxR.get_maxp().x;
+				if (hasL && hasR && (costSplit < std::min(costL, costR)) && state.reserveDuplicate()) {
+					refsL.push_back({ ref.prim, boxL });
+					refsR.push_back({ ref.prim, boxR });
+					continue;
+				}
+				if ((hasL && !hasR) || (hasL == hasR && costL <= costR)) {
+					refsL.push_back(ref);
+					spatialBoxL = wholeL;
+					spatialCountR--;
+				} else {
+					refsR.push_back(ref);
+					spatialBoxR = wholeR;
+					spatialCountL--;
+				}
+			}
+		}
+	}
+	if (refsL.empty() || refsR.empty()) {
+		refsL.clear();
+		refsR.clear();
+		if (objectAxis >= 0) {
+			for (const SBVHReference& ref : refs) ((objectBin(ref, objectAxis) <= objectBinSplit) ? refsL : refsR).push_back(ref);
+		} else {
+			// all the centers at one point: split the list in half
+			refsL.assign(refs.begin(), refs.begin() + ref_num / 2);
+			refsR.assign(refs.begin() + ref_num / 2, refs.end());
+		}
+	}
+	std::vector<SBVHReference>().swap(refs);
+
+	AABB bboxL, bboxR;
+	for (const SBVHReference& ref : refsL) bboxL.fit(ref.bbox);
+	for (const SBVHReference& ref : refsR) bboxR.fit(ref.bbox);
+
+	// recursive call to build a tree (a large left subtree becomes a task on another thread if there is one to spare)
+	const int temp_id = state.nodeNum++;
+	this->node[temp_id].bbox = bbox;
+	this->node[temp_id].isLeaf = false;
+	if ((refsL.size() >= BVHTaskMin) && (refsR.size() >= BVHTaskMin) && acquireBVHBuildThread()) {
+		std::thread task([&]() { this->node[temp_id].idLeft = splitSBVH(state, refsL, bboxL); });
+		this->node[temp_id].idRight = splitSBVH(state, refsR, bboxR);
+		task.join();
+		globalBVHBuildThreads++;
+	} else {
+		this->node[temp_id].idLeft = splitSBVH(state, refsL, bboxL);
+		this->node[temp_id].idRight = splitSBVH(state, refsR, bboxR);
+	}
+	return temp_id;
+}
+
+
+// spread the lowest 10 (21) bits of v so that there are two zeros between them
+static uint64_t mortonSpread3(uint64_t v, const int bits) {
+	if (bits <= 10) {
+		v &= 0x3ff;
+		v = (v | (v << 16)) & 0x030000ff;
+		v = (v | (v << 8)) & 0x0300f00f;
+		v = (v | (v << 4)) & 0x030c30c3;
+		v = (v | (v << 2)) & 0x09249249;
+		return v;
+	}
+	v &= 0x1fffff;
+	v = (v | (v << 32)) & 0x1f00000000ffffull;
+	v = (v | (v << 16)) & 0x1f0000ff0000ffull;
+	v = (v | (v << 8)) & 0x100f00f00f00f00full;
+	v = (v | (v << 4)) & 0x10c30c30c30c30c3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+static int countLeadingZeros64(uint64_t x) {
+	if (x == 0) return 64;
+	int n = 0;
+	for (int shift = 32; shift > 0; shift >>= 1) {
+		if (!(x >> (64 - shift))) {
+			n += shift;
+			x <<= shift;
+		}
+	}
+	return n;
+}
+
+
+void BVH::buildLBVH(BuildState& state, int* obj_index, const int obj_num) {
+	const int bits = (globalLBVHMortonBits > 30) ? 21 : 10;
+
+	// the codes are relative to the box of the centers
+	const int chunks = acquireBVHChunks(obj_num, BVHChunkMin);
+	std::vector<AABB> chunkCenters(chunks);
+	runBVHChunks(obj_num, chunks, [&](const int c, const int begin, const int end) {
+		for (int i = begin; i < end; ++i) {
+			chunkCenters[c].fit(triangleMesh->triangles[obj_index[i]].center);
+		}
+	});
+	AABB centers;
+	for (const AABB& box : chunkCenters) centers.fit(box);
+	const float3 centerMin = centers.get_minp();
+	const float3 centerSize = centers.get_size();
+	const float cells = float(1 << bits);
+
+	std::vector<uint64_t> codes(obj_num), tempCodes(obj_num);
+	std::vector<int> sorted(obj_num), tempSorted(obj_num);
+	runBVHChunks(obj_num, chunks, [&](const int c, const int begin, const int end) {
+		for (int i = begin; i < end; ++i) {
+			const float3& center = triangleMesh->triangles[obj_index[i]].center;
+			uint64_t code = 0;
+			for (int axis = 0; axis < 3; ++axis) {
+				const float x = (centerSize[axis] > 0.0f) ? (center[axis] - centerMin[axis]) / centerSize[axis] : 0.0f;
+				const uint64_t cell = uint64_t(std::min(std::max(x * cells, 0.0f), cells - 1.0f));
+				code |= mortonSpread3(cell, bits) << (2 - axis);
+			}
+			codes[i] = code;
+			sorted[i] = obj_index[i];
+		}
+	});
+	globalBVHBuildThreads += chunks - 1;
+
+	// LSD radix sort, 8 bits per pass
+	for (int shift = 0; shift < 3 * bits; shift += 8) {
+		int offsets[257] = { 0 };
+		for (int i = 0; i < obj_num; ++i) offsets[((codes[i] >> shift) & 0xff) + 1]++;
+		for (int b = 0; b < 256; ++b) offsets[b + 1] += offsets[b];
+		for (int i = 0; i < obj_num; ++i) {
+			const int k = offsets[(codes[i] >> shift) & 0xff]++;
+			tempCodes[k] = codes[i];
+			tempSorted[k] = sorted[i];
+		}
+		std::swap(codes, tempCodes);
+		std::swap(sorted, tempSorted);
+	}
+
+	AABB bbox;
+	emitLBVH(state, codes.data(), sorted.data(), 0, obj_num - 1, bbox);
+
+	if (globalLBVHTreelets) {
+		std::vector<float> costs(state.nodeNum);
+		optimizeTreelets(0, costs);
+	}
+}
+
+
+int BVH::emitLBVH(BuildState& state, const uint64_t* codes, const int* sorted, const int first, const int last, AABB& bbox) {
+	const int temp_id = state.nodeNum++;
+	const int count = last - first + 1;
+	bbox.reset();
+
+	if (count <= 4) {
+		this->node[temp_id].isLeaf = true;
+		this->node[temp_id].triListNum = count;
+		this->node[temp_id].triList = new int[count];
+		for (int i = 0; i < count; i++) {
+			const Triangle& tri = triangleMesh->triangles[sorted[first + i]];
+			this->node[temp_id].triList[i] = sorted[first + i];
+			bbox.fit(tri.positions[0]);
+			bbox.fit(tri.positions[1]);
+			bbox.fit(tri.positions[2]);
+		}
+		this->node[temp_id].bbox = bbox;
+		state.leafNum++;
+		return temp_id;
+	}
+
+	// the last index that shares more than the common prefix of the range with the first one
+	// (the middle if all the codes are the same)
+	int split = (first + last) / 2;
+	const int prefix = countLeadingZeros64(codes[first] ^ codes[last]);
+	if (prefix < 64) {
+		split = first;
+		int step = last - first;
+		do {
+			step = (step + 1) >> 1;
+			const int candidate = split + step;
+			if ((candidate < last) && (countLeadingZeros64(codes[first] ^ codes[candidate]) > prefix)) split = candidate;
+		} while (step > 1);
+	}
+
+	AABB bboxL, bboxR;
+	this->node[temp_id].isLeaf = false;
+	if ((split - first + 1 >= BVHTaskMin) && (last - split >= BVHTaskMin) && acquireBVHBuildThread()) {
+		std::thread task([&]() { this->node[temp_id].idLeft = emitLBVH(state, codes, sorted, first, split, bboxL); });
+		this->node[temp_id].idRight = emitLBVH(state, codes, sorted, split + 1, last, bboxR);
+		task.join();
+		globalBVHBuildThreads++;
+	} else {
+		this->node[temp_id].idLeft = emitLBVH(state, codes, sorted, first, split, bboxL);
+		this->node[temp_id].idRight = emitLBVH(state, codes, sorted, split + 1, last, bboxR);
+	}
+	bbox.fit(bboxL);
+	bbox.fit(bboxR);
+	this->node[temp_id].bbox = bbox;
+	return temp_id;
+}
+
+
+// bottom-up treelet restructuring (Karras and Aila, "Fast Parallel Construction of High-Quality Bounding
+// Volume Hierarchies"): the subtree at each node is opened up into its 7 largest descendants, and their
+// best binary tree under the SAH is found by dynamic programming over the subsets
+// "costs" receives the SAH cost of each subtree (in units of area, not divided by the root area)
+void BVH::optimizeTreelets(const int node_id, std::vector<float>& costs) {
+	const BVHNode& root = this->node[node_id];
+	if (root.isLeaf) {
+		costs[node_id] = root.bbox.area() * root.triListNum * costTri;
+		return;
+	}
+	optimizeTreelets(root.idLeft, costs);
+	optimizeTreelets(root.idRight, costs);
+	restructureTreelet(node_id, costs);
+}
+
+
+void BVH::restructureTreelet(const int node_id, std::vector<float>& costs) {
+	const BVHNode& root = this->node[node_id];
+
+	// open up the treelet, always expanding the leaf with the largest area
+	static constexpr int TreeletMax = 7;
+	int leaves[TreeletMax], interior[TreeletMax - 1];
+	int leafNum = 2, interiorNum = 1;
+	leaves[0] = root.idLeft;
+	leaves[1] = root.idRight;
+	interior[0] = node_id;
+	while (leafNum < TreeletMax) {
+		int largest = -1;
+		for (int i = 0; i < leafNum; i++) {
+			if (this->node[leaves[i]].isLeaf) continue;
+			if ((largest < 0) || (this->node[leaves[i]].bbox.area() > this->node[leaves[largest]].bbox.area())) largest = i;
+		}
+		if (largest < 0) break;
+		const BVHNode& expanded = this->node[leaves[largest]];
+		interior[interiorNum++] = leaves[largest];
+		leaves[largest] = expanded.idLeft;
+		leaves[leafNum++] = expanded.idRight;
+	}
+
+	// the best cost of each subset of the leaves
+	const int subsetNum = 1 << leafNum;
+	float bestCost[1 << TreeletMax];
+	int bestPartition[1 << TreeletMax];
+	AABB subsetBox[1 << TreeletMax];
+	for (int subset = 1; subset < subsetNum; subset++) {
+		subsetBox[subset].reset();
+		for (int i = 0; i < leafNum; i++) {
+			if (subset & (1 << i)) subsetBox[subset].fit(this->node[leaves[i]].bbox);
+		}
+		bestPartition[subset] = 0;
+		if ((subset & (subset - 1)) == 0) {
+			int i = 0;
+			while (!(subset & (1 << i))) i++;
+			bestCost[subset] = costs[leaves[i]];
+			continue;
+		}
+		// the lowest leaf always goes to the left, so each partition is visited once
+		const int lowest = subset & (-subset);
+		float best = FLT_MAX;
+		for (int left = (subset - 1) & subset; left != 0; left = (left - 1) & subset) {
+			if (!(left & lowest)) continue;
+			const float cost = bestCost[left] + bestCost[subset & ~left];
+			if (cost < best) {
+				best = cost;
+				bestPartition[subset] = left;
+			}
+		}
+		bestCost[subset] = subsetBox[subset].area() * costBBox + best;
+	}
+
+	// the current cost of the treelet
+	float current = 0.0f;
+	for (int i = 0; i < interiorNum; i++) current += this->node[interior[i]].bbox.area() * costBBox;
+	for (int i = 0; i < leafNum; i++) current += costs[leaves[i]];
+
+	const int all = subsetNum - 1;
+	if (bestCost[all] < current * 0.9999f) {
+		// rebuild the treelet with the same interior nodes
+		int nextInterior = 1;
+		std::function<int(int, int)> emit = [&](const int subset, const int id) -> int {
+			if ((subset & (subset - 1)) == 0) {
+				int i = 0;
+				while (!(subset & (1 << i))) i++;
+				return leaves[i];
+			}
+			const int nodeId = (id >= 0) ? id : interior[nextInterior++];
+			const int left = bestPartition[subset];
+			this->node[nodeId].isLeaf = false;
+			this->node[nodeId].bbox = subsetBox[subset];
+			this->node[nodeId].idLeft = emit(left, -1);
+			this->node[nodeId].idRight = emit(subset & ~left, -1);
+			costs[nodeId] = bestCost[subset];
+			return nodeId;
+		};
+		emit(all, node_id);
+	} else {
+		costs[node_id] = root.bbox.area() * costBBox + costs[root.idLeft] + costs[root.idRight];
+	}
+}
+
+
 // you may keep this part as-is
-void BVH::build(const TriangleMesh* mesh) {
+void BVH::build(const TriangleMesh* mesh, const enumBVHBuilder bvhBuilder, const bool verbose) {
+	release();
 	triangleMesh = mesh;
+	builder = bvhBuilder;
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	// a cached BVH of the same file and settings is used as it is
+	const uint64_t key = cacheKey(mesh, bvhBuilder);
+	if (key && loadCache(mesh, key)) {
+#ifdef CS488_SSE
+		if (globalWideBVH) buildWide();
+#endif
+		this->buildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		if (verbose) printf("Loaded BVH from the cache (%s, %.1f ms, %d nodes, depth %d, SAH cost %.1f, %d KB).\n", BVHBuilderNames[builder], buildTime, nodeNum, maxDepth, builtSAHCost, int(memoryUsage() / 1024));
+		if (verbose && wideNodes) printf("4-wide BVH: %d nodes, depth %d, %d KB.\n", wideNodeNum, wideDepth, int(wideNodeNum * sizeof(WideBVHNode) / 1024));
+		return;
+	}
 
 	// construct the bounding volume hierarchy
 	const int obj_num = (int)(triangleMesh->triangles.size());
@@ -1626,25 +3098,375 @@ void BVH::build(const TriangleMesh* mesh) {
 		obj_index[i] = i;
 	}
 	this->nodeNum = 0;
-	this->node = new BVHNode[obj_num * 2];
+	// (spatial splits add up to globalSBVHDuplication * obj_num references, and each leaf has at least one)
+	const int duplicateBudget = (builder == BVH_SBVH) ? int(int64_t(double(obj_num) * duplicationFactor())) : 0;
+	this->node = new BVHNode[(obj_num + duplicateBudget) * 2];
 	this->leafNum = 0;
 
+	// ---------- buliding BVH ----------
+	if (verbose) printf("Building BVH...\n");
+
 	// calculate a scene bounding box
+	const int chunks = acquireBVHChunks(obj_num, BVHChunkMin);
+	std::vector<AABB> chunkBoxes(chunks);
+	runBVHChunks(obj_num, chunks, [&](const int c, const int begin, const int end) {
+		for (int i = begin; i < end; i++) {
+			const Triangle& tri = triangleMesh->triangles[obj_index[i]];
+
+			chunkBoxes[c].fit(tri.positions[0]);
+			chunkBoxes[c].fit(tri.positions[1]);
+			chunkBoxes[c].fit(tri.positions[2]);
+		}
+	});
+	globalBVHBuildThreads += chunks - 1;
 	AABB bbox;
-	for (int i = 0; i < obj_num; i++) {
-		const Triangle& tri = triangleMesh->triangles[obj_index[i]];
+	for (const AABB& box : chunkBoxes) bbox.fit(box);
+
+	BuildState state;
+	if (builder == BVH_LBVH) {
+		buildLBVH(state, obj_index, obj_num);
+	} else if (builder == BVH_SBVH) {
+		std::vector<SBVHReference> refs(obj_num);
+		for (int i = 0; i < obj_num; i++) refs[i] = { i, triangleMesh->triangles[i].bbox };
+		state.duplicateBudget = duplicateBudget;
+		state.rootArea = bbox.area();
+		if (obj_num > 0) splitSBVH(state, refs, bbox);
+	} else {
+		splitBVH(state, obj_index, obj_num, bbox);
+	}
+	this->nodeNum = state.nodeNum;
+	this->leafNum = state.leafNum;
+	flatten();
+#ifdef CS488_SSE
+	if (globalWideBVH) buildWide();
+#endif
+	this->buildTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	this->maxDepth = (nodeNum > 0) ? depth(0) : 0;
+	this->builtSAHCost = sahCost();
+	this->builtTriangleNum = obj_num;
+	if (verbose) printf("Done (%s, %.1f ms, %d nodes, depth %d, SAH cost %.1f, %d KB).\n", BVHBuilderNames[builder], buildTime, nodeNum, maxDepth, builtSAHCost, int(memoryUsage() / 1024));
+	if (verbose && hasDuplicates()) printf("%d references to %d triangles.\n", primNum, obj_num);
+	if (key) saveCache(key);
+	if (verbose && wideNodes) printf("4-wide BVH: %d nodes, depth %d, %d KB.\n", wideNodeNum, wideDepth, int(wideNodeNum * sizeof(WideBVHNode) / 1024));
 
-		bbox.fit(tri.positions[0]);
-		bbox.fit(tri.positions[1]);
-		bbox.fit(tri.positions[2]);
+	delete[] obj_index;
+}
+
+
+void BVH::flatten() {
+	primNum = 0;
+	for (int i = 0; i < nodeNum; i++) {
+		if (node[i].isLeaf) primNum += node[i].triListNum;
+	}
+	if (primNum == 0) {
+		// an empty mesh has no nodes (a leaf needs at least one triangle)
+		releaseBuildNodes();
+		nodeNum = 0;
+		leafNum = 0;
+		return;
 	}
 
-	// ---------- buliding BVH ----------
-	printf("Building BVH...\n");
-	splitBVH(obj_index, obj_num, bbox);
-	printf("Done.\n");
+	// aligned so that a node and its left child usually share a cache line
+	flatNodeStorage = new unsigned char[nodeNum * sizeof(FlatBVHNode) + 64];
+	flatNodes = (FlatBVHNode*)(flatNodeStorage + ((64 - (uintptr_t)flatNodeStorage % 64) % 64));
+	for (int i = 0; i < nodeNum; i++) new (&flatNodes[i]) FlatBVHNode();
+	primIndices = new int[primNum];
 
-	delete[] obj_index;
+	int nextNode = 0, nextPrim = 0;
+	if (nodeNum > 0) flattenNode(0, nextNode, nextPrim);
+	releaseBuildNodes();
+}
+
+
+int BVH::flattenNode(const int node_id, int& nextNode, int& nextPrim) {
+	const BVHNode& current = this->node[node_id];
+	const int flat_id = nextNode++;
+	FlatBVHNode& flat = this->flatNodes[flat_id];
+	flat.bbox = current.bbox;
+	if (current.isLeaf) {
+		flat.offset = nextPrim;
+		flat.count = current.triListNum;
+		for (int i = 0; i < current.triListNum; i++) primIndices[nextPrim++] = current.triList[i];
+	} else {
+		flat.count = 0;
+		flattenNode(current.idLeft, nextNode, nextPrim);
+		flat.offset = flattenNode(current.idRight, nextNode, nextPrim);
+	}
+	return flat_id;
+}
+
+
+void BVH::releaseBuildNodes() {
+	if (!node) return;
+	for (int i = 0; i < nodeNum; i++) {
+		if (node[i].isLeaf) delete[] node[i].triList;
+	}
+	delete[] node;
+	node = nullptr;
+}
+
+
+void BVH::release() {
+	releaseBuildNodes();
+	delete[] flatNodeStorage;
+	delete[] wideNodeStorage;
+	if (cacheBase) {
+		releaseCache();
+	} else {
+		delete[] primIndices;
+	}
+	flatNodeStorage = nullptr;
+	flatNodes = nullptr;
+	wideNodeStorage = nullptr;
+	wideNodes = nullptr;
+	wideNodeNum = 0;
+	wideDepth = 0;
+	primIndices = nullptr;
+	nodeNum = 0;
+	leafNum = 0;
+	primNum = 0;
+}
+
+
+// 0 (no cache) unless the mesh is unchanged from its file and there is a cache directory
+uint64_t BVH::cacheKey(const TriangleMesh* mesh, const enumBVHBuilder bvhBuilder) const {
+	if (globalBVHCacheDir.empty() || (mesh->sourceHash == 0) || mesh->dirty) return 0;
+
+	// everything the tree depends on (only the settings of the builder in use)
+	struct {
+		uint32_t version = BVHCacheVersion;
+		int32_t builder, binNum = BVHBinNum, mortonBits = 0, treelets = 0;
+		float costBBox, costTri, duplication = 0.0f;
+	} settings;
+	settings.builder = bvhBuilder;
+	settings.costBBox = costBBox;
+	settings.costTri = costTri;
+	if (bvhBuilder == BVH_LBVH) {
+		settings.mortonBits = globalLBVHMortonBits;
+		settings.treelets = globalLBVHTreelets;
+	}
+	if (bvhBuilder == BVH_SBVH) settings.duplication = duplicationFactor();
+	const uint64_t key = hashBytes(&settings, sizeof(settings), mesh->sourceHash);
+	return (key == 0) ? 1 : key;
+}
+
+
+std::string BVH::cachePath(const uint64_t key) const {
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long)key);
+	return globalBVHCacheDir + "/" + name;
+}
+
+
+bool BVH::loadCache(const TriangleMesh* mesh, const uint64_t key) {
+	const std::string path = cachePath(key);
+#ifdef _WIN32
+	// no mmap: the file is read into a buffer of the same layout
+	FILE* fp = fopen(path.c_str(), "rb");
+	if (!fp) return false;
+	fseek(fp, 0, SEEK_END);
+	const size_t size = size_t(ftell(fp));
+	fseek(fp, 0, SEEK_SET);
+	unsigned char* storage = new unsigned char[size + 64];
+	unsigned char* data = storage + ((64 - (uintptr_t)storage % 64) % 64);
+	const bool complete = (fread(data, 1, size, fp) == size);
+	fclose(fp);
+	cacheBase = storage;
+	cacheSize = size;
+	if (!complete) {
+		releaseCache();
+		return false;
+	}
+#else
+	const int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+	struct stat st;
+	if ((fstat(fd, &st) != 0) || (size_t(st.st_size) < sizeof(CacheHeader))) {
+		close(fd);
+		return false;
+	}
+	const size_t size = size_t(st.st_size);
+	void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+	unsigned char* data = (unsigned char*)mapping;
+	cacheBase = mapping;
+	cacheSize = size;
+#endif
+
+	const CacheHeader& header = *(const CacheHeader*)data;
+	const bool valid = (size >= sizeof(CacheHeader)) && (memcmp(header.magic, "CS488BVH", 8) == 0) && (header.version == BVHCacheVersion) &&
+		(header.nodeSize == sizeof(FlatBVHNode)) && (header.key == key) && (header.triangleNum == int(mesh->triangles.size())) &&
+		(header.builder == int(builder)) && (header.nodeNum > 0) && (header.primNum > 0) &&
+		(size == sizeof(CacheHeader) + size_t(header.nodeNum) * sizeof(FlatBVHNode) + size_t(header.primNum) * sizeof(int));
+	if (!valid) {
+		releaseCache();
+		return false;
+	}
+	const FlatBVHNode* nodes = (const FlatBVHNode*)(data + sizeof(CacheHeader));
+	const int* prims = (const int*)(data + sizeof(CacheHeader) + size_t(header.nodeNum) * sizeof(FlatBVHNode));
+	if (!validCacheTree(header, nodes, prims)) {
+		releaseCache();
+		return false;
+	}
+	flatNodes = (FlatBVHNode*)nodes;
+	primIndices = (int*)prims;
+	nodeNum = header.nodeNum;
+	primNum = header.primNum;
+	leafNum = header.leafNum;
+	maxDepth = header.maxDepth;
+	builtSAHCost = header.sahCost;
+	builtTriangleNum = header.triangleNum;
+	return true;
+}
+
+
+// the tree is traversed as it is, so every index in it has to be in range and the stored depth (which picks the
+// traversal stacks) has to be right; one pass, since children come after their parents
+bool BVH::validCacheTree(const CacheHeader& header, const FlatBVHNode* nodes, const int* prims) {
+	for (int i = 0; i < header.primNum; i++) {
+		if ((prims[i] < 0) || (prims[i] >= header.triangleNum)) return false;
+	}
+	std::vector<int> depths(header.nodeNum, 0);
+	depths[0] = 1;
+	int leaves = 0, deepest = 0;
+	for (int i = 0; i < header.nodeNum; i++) {
+		const FlatBVHNode& n = nodes[i];
+		if (depths[i] == 0) return false;
+		deepest = std::max(deepest, depths[i]);
+		if (n.count > 0) {
+			if ((n.offset < 0) || (n.offset > header.primNum - n.count)) return false;
+			leaves++;
+		} else {
+			if ((n.count < 0) || (i + 1 >= header.nodeNum) || (n.offset <= i + 1) || (n.offset >= header.nodeNum)) return false;
+			depths[i + 1] = std::max(depths[i + 1], depths[i] + 1);
+			depths[n.offset] = std::max(depths[n.offset], depths[i] + 1);
+		}
+	}
+	return (leaves == header.leafNum) && (deepest == header.maxDepth);
+}
+
+
+// written to a temporary file first and then renamed, so that processes that share the cache never see half a file
+void BVH::saveCache(const uint64_t key) const {
+	if (nodeNum == 0) return;
+	CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "CS488BVH", 8);
+	header.version = BVHCacheVersion;
+	header.nodeSize = sizeof(FlatBVHNode);
+	header.key = key;
+	header.triangleNum = builtTriangleNum;
+	header.nodeNum = nodeNum;
+	header.primNum = primNum;
+	header.leafNum = leafNum;
+	header.maxDepth = maxDepth;
+	header.builder = builder;
+	header.sahCost = builtSAHCost;
+
+	const std::string path = cachePath(key);
+	const std::string temp = path + "." + std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()) ^ uint64_t(std::chrono::steady_clock::now().time_since_epoch().count())) + ".tmp";
+	FILE* fp = fopen(temp.c_str(), "wb");
+	if (!fp) {
+		printf("Could not write the BVH cache \"%s\".\n", temp.c_str());
+		return;
+	}
+	const bool complete = (fwrite(&header, sizeof(header), 1, fp) == 1) && (fwrite(flatNodes, sizeof(FlatBVHNode), nodeNum, fp) == size_t(nodeNum)) &&
+		(fwrite(primIndices, sizeof(int), primNum, fp) == size_t(primNum));
+	if ((fclose(fp) != 0) || !complete || (rename(temp.c_str(), path.c_str()) != 0)) remove(temp.c_str());
+}
+
+
+void BVH::releaseCache() {
+	if (!cacheBase) return;
+#ifdef _WIN32
+	delete[] (unsigned char*)cacheBase;
+#else
+	munmap(cacheBase, cacheSize);
+#endif
+	cacheBase = nullptr;
+	cacheSize = 0;
+	flatNodes = nullptr;
+	primIndices = nullptr;
+}
+
+
+float BVH::sahCost() const {
+	if (nodeNum == 0) return 0.0f;
+	float cost = 0.0f;
+	for (int i = 0; i < nodeNum; i++) {
+		const float a = flatNodes[i].bbox.area();
+		cost += flatNodes[i].isLeaf() ? a * flatNodes[i].count * costTri : a * costBBox;
+	}
+	return cost / flatNodes[0].bbox.area();
+}
+
+
+int BVH::depth(const int node_id) const {
+	if (this->flatNodes[node_id].isLeaf()) return 1;
+	return 1 + std::max(depth(node_id + 1), depth(this->flatNodes[node_id].offset));
+}
+
+
+// the subtree of a node is the range [node_id, subtreeEnd(node_id)) of the depth-first layout
+int BVH::subtreeEnd(const int node_id) const {
+	int last = node_id;
+	while (!this->flatNodes[last].isLeaf()) last = this->flatNodes[last].offset;
+	return last + 1;
+}
+
+
+// children come after their parent, so refitting a range from the back only uses boxes that are already updated
+void BVH::refitNode(const int node_id) {
+	FlatBVHNode& current = this->flatNodes[node_id];
+	current.bbox.reset();
+	if (current.isLeaf()) {
+		for (int i = 0; i < current.count; i++) current.bbox.fit(triangleMesh->triangles[this->primIndices[current.offset + i]].bbox);
+	} else {
+		current.bbox.fit(this->flatNodes[node_id + 1].bbox);
+		current.bbox.fit(this->flatNodes[current.offset].bbox);
+	}
+}
+
+
+bool BVH::refit(const TriangleMesh* mesh) {
+	if ((globalBVHRefitThreshold <= 0.0f) || (mesh != triangleMesh) || (nodeNum == 0) || (int(mesh->triangles.size()) != builtTriangleNum)) return false;
+	const auto start = std::chrono::high_resolution_clock::now();
+
+	// open up the largest subtree until every thread has a few to take, the nodes above them are refitted last
+	const int chunks = acquireBVHChunks(nodeNum, BVHRefitChunkMin);
+	std::vector<int> subtrees(1, 0), upper;
+	while ((chunks > 1) && (int(subtrees.size()) < 4 * chunks)) {
+		int largest = -1, largestSize = 0;
+		for (int i = 0; i < int(subtrees.size()); i++) {
+			const int size = subtreeEnd(subtrees[i]) - subtrees[i];
+			if ((size > largestSize) && !this->flatNodes[subtrees[i]].isLeaf()) {
+				largest = i;
+				largestSize = size;
+			}
+		}
+		if ((largest < 0) || (largestSize < BVHRefitChunkMin / 4)) break;
+		const int node_id = subtrees[largest];
+		upper.push_back(node_id);
+		subtrees[largest] = node_id + 1;
+		subtrees.push_back(this->flatNodes[node_id].offset);
+	}
+
+	// the subtrees differ in size, so each thread takes the next one until none are left
+	std::atomic<int> next(0);
+	runBVHChunks(chunks, chunks, [&](const int, const int, const int) {
+		for (int i = next++; i < int(subtrees.size()); i = next++) {
+			for (int node_id = subtreeEnd(subtrees[i]) - 1; node_id >= subtrees[i]; node_id--) refitNode(node_id);
+		}
+	});
+	globalBVHBuildThreads += chunks - 1;
+	for (int i = int(upper.size()) - 1; i >= 0; i--) refitNode(upper[i]);
+
+#ifdef CS488_SSE
+	if (wideNodes) buildWide();
+#endif
+	this->refitTime = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	return sahCost() <= globalBVHRefitThreshold * builtSAHCost;
 }
 
 
@@ -1654,32 +3476,34 @@ bool BVH::traverse(HitInfo& minHit, const Ray& ray, int node_id, float tMin, flo
 	HitInfo tempMinHit, tempMinHitL, tempMinHitR;
 	bool hit1, hit2;
 
-	if (this->node[node_id].isLeaf) {
-		for (int i = 0; i < (this->node[node_id].triListNum); ++i) {
-			if (triangleMesh->raytraceTriangle(tempMinHit, ray, triangleMesh->triangles[this->node[node_id].triList[i]], tMin, tMax)) {
+	const FlatBVHNode& current = this->flatNodes[node_id];
+	if (current.isLeaf()) {
+		for (int i = 0; i < current.count; ++i) {
+			if (triangleMesh->raytraceTriangle(tempMinHit, ray, triangleMesh->triangles[this->primIndices[current.offset + i]], tMin, tMax)) {
 				hit = true;
 				if (tempMinHit.t < minHit.t) minHit = tempMinHit;
 			}
 		}
 	} else {
-		hit1 = this->node[this->node[node_id].idLeft].bbox.intersect(tempMinHitL, ray);
-		hit2 = this->node[this->node[node_id].idRight].bbox.intersect(tempMinHitR, ray);
+		const int idLeft = node_id + 1, idRight = current.offset;
+		hit1 = this->flatNodes[idLeft].bbox.intersect(tempMinHitL, ray);
+		hit2 = this->flatNodes[idRight].bbox.intersect(tempMinHitR, ray);
 
 		hit1 = hit1 && (tempMinHitL.t < minHit.t);
 		hit2 = hit2 && (tempMinHitR.t < minHit.t);
 
 		if (hit1 && hit2) {
 			if (tempMinHitL.t < tempMinHitR.t) {
-				hit = traverse(minHit, ray, this->node[node_id].idLeft, tMin, tMax);
-				hit = traverse(minHit, ray, this->node[node_id].idRight, tMin, tMax);
+				hit = traverse(minHit, ray, idLeft, tMin, tMax);
+				hit = traverse(minHit, ray, idRight, tMin, tMax);
 			} else {
-				hit = traverse(minHit, ray, this->node[node_id].idRight, tMin, tMax);
-				hit = traverse(minHit, ray, this->node[node_id].idLeft, tMin, tMax);
+				hit = traverse(minHit, ray, idRight, tMin, tMax);
+				hit = traverse(minHit, ray, idLeft, tMin, tMax);
 			}
 		} else if (hit1) {
-			hit = traverse(minHit, ray, this->node[node_id].idLeft, tMin, tMax);
+			hit = traverse(minHit, ray, idLeft, tMin, tMax);
 		} else if (hit2) {
-			hit = traverse(minHit, ray, this->node[node_id].idRight, tMin, tMax);
+			hit = traverse(minHit, ray, idRight, tMin, tMax);
 		}
 	}
 
@@ -1687,6 +3511,424 @@ bool BVH::traverse(HitInfo& minHit, const Ray& ray, int node_id, float tMin, flo
 }
 
 
+bool BVH::intersectIterative(HitInfo& result, const Ray& ray, float tMin, float tMax) const {
+	struct StackEntry {
+		float tNear;
+		int node_id;
+	};
+	StackEntry stack[TraversalStackSize];
+	int stackSize = 0;
+
+	float tNear;
+	if ((nodeNum == 0) || !this->flatNodes[0].bbox.intersect(tNear, ray) || !(tNear < tMax)) return false;
+
+	float tBest = tMax;
+	int bestPrim = -1;
+	float bestBeta = 0.0f, bestGamma = 0.0f;
+	TriangleMailbox mailbox;
+	const bool duplicates = hasDuplicates();
+	int node_id = 0;
+	while (true) {
+		const FlatBVHNode& current = this->flatNodes[node_id];
+		if (current.isLeaf()) {
+			for (int i = 0; i < current.count; ++i) {
+				const int prim = this->primIndices[current.offset + i];
+				if (duplicates && mailbox.visited(prim)) continue;
+				float t, beta, gamma;
+				if (triangleMesh->intersectTriangle(ray, triangleMesh->triangles[prim], tMin, tBest, t, beta, gamma)) {
+					tBest = t;
+					bestPrim = prim;
+					bestBeta = beta;
+					bestGamma = gamma;
+				}
+			}
+		} else {
+			const int idLeft = node_id + 1, idRight = current.offset;
+			float tNearL, tNearR;
+			const bool hitL = this->flatNodes[idLeft].bbox.intersect(tNearL, ray) && (tNearL < tBest);
+			const bool hitR = this->flatNodes[idRight].bbox.intersect(tNearR, ray) && (tNearR < tBest);
+			if (hitL && hitR) {
+				if (tNearL < tNearR) {
+					stack[stackSize++] = { tNearR, idRight };
+					node_id = idLeft;
+				} else {
+					stack[stackSize++] = { tNearL, idLeft };
+					node_id = idRight;
+				}
+				continue;
+			} else if (hitL) {
+				node_id = idLeft;
+				continue;
+			} else if (hitR) {
+				node_id = idRight;
+				continue;
+			}
+		}
+
+		// next node that the ray can still reach before its closest hit
+		while ((stackSize > 0) && !(stack[stackSize - 1].tNear < tBest)) stackSize--;
+		if (stackSize == 0) break;
+		node_id = stack[--stackSize].node_id;
+	}
+
+	if (bestPrim < 0) return false;
+	triangleMesh->fillHitInfo(result, ray, triangleMesh->triangles[bestPrim], tBest, bestBeta, bestGamma);
+	return true;
+}
+
+
+bool BVH::occludedNode(const Ray& ray, int node_id, float tMin, float tMax, bool cullBackFaces, TriangleMailbox* mailbox) const {
+	const FlatBVHNode& current = this->flatNodes[node_id];
+	if (current.isLeaf()) {
+		for (int i = 0; i < current.count; ++i) {
+			const int prim = this->primIndices[current.offset + i];
+			if (mailbox && mailbox->visited(prim)) continue;
+			if (triangleMesh->occludeTriangle(ray, triangleMesh->triangles[prim], tMin, tMax, cullBackFaces)) return true;
+		}
+		return false;
+	}
+
+	// any hit will do, so the order of the children does not matter
+	float tNear;
+	if (this->flatNodes[node_id + 1].bbox.intersect(tNear, ray) && (tNear <= tMax)) {
+		if (occludedNode(ray, node_id + 1, tMin, tMax, cullBackFaces, mailbox)) return true;
+	}
+	if (this->flatNodes[current.offset].bbox.intersect(tNear, ray) && (tNear <= tMax)) {
+		if (occludedNode(ray, current.offset, tMin, tMax, cullBackFaces, mailbox)) return true;
+	}
+	return false;
+}
+
+
+#ifdef CS488_SSE
+// slab test of a ray packet against a box
+// returns a lane mask of the rays that enter the box before their current closest hit
+static inline __m128 intersectBoxPacket(const AABB& bbox, const RayPacket& packet, const __m128 tHit, __m128& tNear) {
+	const float3 minp = bbox.get_minp();
+	const float3 maxp = bbox.get_maxp();
+
+	const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minp.x), packet.ox), packet.idx);
+	const __m128 tx2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxp.x), packet.ox), packet.idx);
+	const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minp.y), packet.oy), packet.idy);
+	const __m128 ty2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxp.y), packet.oy), packet.idy);
+	const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(minp.z), packet.oz), packet.idz);
+	const __m128 tz2 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(maxp.z), packet.oz), packet.idz);
+
+	tNear = _mm_max_ps(_mm_max_ps(_mm_min_ps(tx1, tx2), _mm_min_ps(ty1, ty2)), _mm_min_ps(tz1, tz2));
+	__m128 tFar = _mm_min_ps(_mm_min_ps(_mm_max_ps(tx1, tx2), _mm_max_ps(ty1, ty2)), _mm_max_ps(tz1, tz2));
+
+	// widen the far distance slightly so that flat boxes (e.g., axis-aligned walls) are not lost to rounding
+	tFar = _mm_mul_ps(tFar, _mm_set1_ps(1.0f + 1e-6f));
+
+	return _mm_and_ps(_mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmpge_ps(tFar, _mm_setzero_ps())), _mm_cmplt_ps(tNear, tHit));
+}
+
+
+void BVH::intersectPacket(PacketHit& hit, const RayPacket& packet, const int objectId, const float tMin) const {
+	struct StackEntry {
+		__m128 tNear;
+		int node_id;
+	};
+	StackEntry stack[PacketStackSize];
+	int stackSize = 0;
+
+	const __m128 inf = _mm_set1_ps(FLT_MAX);
+	__m128 tNear;
+	if (nodeNum == 0) return;
+	const __m128 mask = intersectBoxPacket(this->flatNodes[0].bbox, packet, _mm_load_ps(hit.t), tNear);
+	if (_mm_movemask_ps(mask) == 0) return;
+	stack[stackSize++] = { _mm_or_ps(_mm_and_ps(mask, tNear), _mm_andnot_ps(mask, inf)), 0 };
+
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+
+		// the closest hits may have moved in front of this node since it was pushed
+		const __m128 active = _mm_cmplt_ps(entry.tNear, _mm_load_ps(hit.t));
+		if (_mm_movemask_ps(active) == 0) continue;
+
+		const FlatBVHNode& current = this->flatNodes[entry.node_id];
+		if (current.isLeaf()) {
+			for (int i = 0; i < current.count; ++i) {
+				triangleMesh->raytraceTrianglePacket(hit, packet, this->primIndices[current.offset + i], objectId, active, tMin);
+			}
+		} else {
+			const int idLeft = entry.node_id + 1, idRight = current.offset;
+			const __m128 tHit = _mm_load_ps(hit.t);
+			__m128 tNearL, tNearR;
+			const __m128 maskL = _mm_and_ps(active, intersectBoxPacket(this->flatNodes[idLeft].bbox, packet, tHit, tNearL));
+			const __m128 maskR = _mm_and_ps(active, intersectBoxPacket(this->flatNodes[idRight].bbox, packet, tHit, tNearR));
+			const bool hitL = _mm_movemask_ps(maskL) != 0;
+			const bool hitR = _mm_movemask_ps(maskR) != 0;
+
+			// rays that miss a child stay inactive in its subtree
+			tNearL = _mm_or_ps(_mm_and_ps(maskL, tNearL), _mm_andnot_ps(maskL, inf));
+			tNearR = _mm_or_ps(_mm_and_ps(maskR, tNearR), _mm_andnot_ps(maskR, inf));
+
+			if (hitL && hitR) {
+				// visit the child that the packet enters first
+				alignas(16) float nearL[PacketSize], nearR[PacketSize];
+				_mm_store_ps(nearL, tNearL);
+				_mm_store_ps(nearR, tNearR);
+				float minL = FLT_MAX, minR = FLT_MAX;
+				for (int k = 0; k < PacketSize; k++) {
+					minL = std::min(minL, nearL[k]);
+					minR = std::min(minR, nearR[k]);
+				}
+				if (minL < minR) {
+					stack[stackSize++] = { tNearR, idRight };
+					stack[stackSize++] = { tNearL, idLeft };
+				} else {
+					stack[stackSize++] = { tNearL, idLeft };
+					stack[stackSize++] = { tNearR, idRight };
+				}
+			} else if (hitL) {
+				stack[stackSize++] = { tNearL, idLeft };
+			} else if (hitR) {
+				stack[stackSize++] = { tNearR, idRight };
+			}
+		}
+	}
+}
+
+
+__m128 BVH::occludedPacket(const RayPacket& packet, __m128 active, const float tMin, const __m128 tMax, const bool cullBackFaces) const {
+	int stack[PacketStackSize];
+	int stackSize = 0;
+
+	__m128 blocked = _mm_setzero_ps();
+	__m128 tNear;
+	if ((nodeNum == 0) || (_mm_movemask_ps(_mm_and_ps(active, intersectBoxPacket(this->flatNodes[0].bbox, packet, tMax, tNear))) == 0)) return blocked;
+	stack[stackSize++] = 0;
+
+	// any hit will do, so the order of the children does not matter and a ray retires at its first blocker
+	while ((stackSize > 0) && (_mm_movemask_ps(active) != 0)) {
+		const int node_id = stack[--stackSize];
+		const FlatBVHNode& current = this->flatNodes[node_id];
+		if (current.isLeaf()) {
+			for (int i = 0; i < current.count; ++i) {
+				const __m128 hit = triangleMesh->occludeTrianglePacket(packet, triangleMesh->triangles[this->primIndices[current.offset + i]], active, tMin, tMax, cullBackFaces);
+				blocked = _mm_or_ps(blocked, hit);
+				active = _mm_andnot_ps(hit, active);
+				if (_mm_movemask_ps(active) == 0) break;
+			}
+		} else {
+			if (_mm_movemask_ps(_mm_and_ps(active, intersectBoxPacket(this->flatNodes[current.offset].bbox, packet, tMax, tNear))) != 0) stack[stackSize++] = current.offset;
+			if (_mm_movemask_ps(_mm_and_ps(active, intersectBoxPacket(this->flatNodes[node_id + 1].bbox, packet, tMax, tNear))) != 0) stack[stackSize++] = node_id + 1;
+		}
+	}
+	return blocked;
+}
+
+
+void BVH::buildWide() {
+	delete[] wideNodeStorage;
+	wideNodeStorage = nullptr;
+	wideNodes = nullptr;
+	wideNodeNum = 0;
+	wideDepth = 0;
+	if (nodeNum == 0) return;
+
+	std::vector<WideBVHNode> wide;
+	wide.reserve(nodeNum / 2 + 1);
+	collapseWide(0, wide, 1);
+
+	// a node pops one entry and pushes up to four
+	if (3 * wideDepth + 1 > WideStackSize) return;
+
+	wideNodeNum = (int)wide.size();
+	wideNodeStorage = new unsigned char[wideNodeNum * sizeof(WideBVHNode) + 64];
+	wideNodes = (WideBVHNode*)(wideNodeStorage + ((64 - (uintptr_t)wideNodeStorage % 64) % 64));
+	memcpy(wideNodes, wide.data(), wideNodeNum * sizeof(WideBVHNode));
+}
+
+
+// the children of a wide node are found by opening up the binary child with the largest box until there are four
+int BVH::collapseWide(const int node_id, std::vector<WideBVHNode>& wide, const int depth) {
+	int children[4];
+	int childNum = 0;
+	if (this->flatNodes[node_id].isLeaf()) {
+		children[childNum++] = node_id;
+	} else {
+		children[childNum++] = node_id + 1;
+		children[childNum++] = this->flatNodes[node_id].offset;
+	}
+	while (childNum < 4) {
+		int largest = -1;
+		for (int i = 0; i < childNum; i++) {
+			if (this->flatNodes[children[i]].isLeaf()) continue;
+			if ((largest < 0) || (this->flatNodes[children[i]].bbox.area() > this->flatNodes[children[largest]].bbox.area())) largest = i;
+		}
+		if (largest < 0) break;
+		const int expanded = children[largest];
+		children[largest] = expanded + 1;
+		children[childNum++] = this->flatNodes[expanded].offset;
+	}
+
+	const int wide_id = (int)wide.size();
+	wide.push_back(WideBVHNode());
+	wideDepth = std::max(wideDepth, depth);
+	for (int i = 0; i < 4; i++) {
+		WideBVHNode& current = wide[wide_id];
+		if (i >= childNum) {
+			// an empty box: the slab test never hits it
+			for (int axis = 0; axis < 3; axis++) {
+				current.bounds[axis][i] = FLT_MAX;
+				current.bounds[axis + 3][i] = -FLT_MAX;
+			}
+			current.child[i] = 0;
+			current.count[i] = -1;
+			continue;
+		}
+		const FlatBVHNode& child = this->flatNodes[children[i]];
+		const float3 minp = child.bbox.get_minp(), maxp = child.bbox.get_maxp();
+		for (int axis = 0; axis < 3; axis++) {
+			current.bounds[axis][i] = minp[axis];
+			current.bounds[axis + 3][i] = maxp[axis];
+		}
+		if (child.isLeaf()) {
+			current.child[i] = child.offset;
+			current.count[i] = child.count;
+		} else {
+			const int grandchild = collapseWide(children[i], wide, depth + 1);
+			wide[wide_id].child[i] = grandchild;
+			wide[wide_id].count[i] = 0;
+		}
+	}
+	return wide_id;
+}
+
+
+// a ray prepared for the slab tests of WideBVHNodes
+struct WideRay {
+	__m128 o[3], invD[3];
+	int nearPlane[3], farPlane[3]; // rows of WideBVHNode::bounds
+
+	explicit WideRay(const Ray& ray) {
+		for (int axis = 0; axis < 3; axis++) {
+			const float inv = 1.0f / ray.d[axis];
+			o[axis] = _mm_set1_ps(ray.o[axis]);
+			invD[axis] = _mm_set1_ps(inv);
+			nearPlane[axis] = (inv >= 0.0f) ? axis : axis + 3;
+			farPlane[axis] = (inv >= 0.0f) ? axis + 3 : axis;
+		}
+	}
+
+	// returns a mask of the children entered before tBest, and their entry distances
+	int intersect(const WideBVHNode& node, const __m128 tBest, __m128& tNear) const {
+		const __m128 tx0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[nearPlane[0]]), o[0]), invD[0]);
+		const __m128 ty0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[nearPlane[1]]), o[1]), invD[1]);
+		const __m128 tz0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[nearPlane[2]]), o[2]), invD[2]);
+		const __m128 tx1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[farPlane[0]]), o[0]), invD[0]);
+		const __m128 ty1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[farPlane[1]]), o[1]), invD[1]);
+		const __m128 tz1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(node.bounds[farPlane[2]]), o[2]), invD[2]);
+		tNear = _mm_max_ps(_mm_max_ps(tx0, ty0), tz0);
+		// (widened slightly like intersectBoxPacket, so that flat boxes are not lost to rounding)
+		const __m128 tFar = _mm_mul_ps(_mm_min_ps(_mm_min_ps(tx1, ty1), tz1), _mm_set1_ps(1.0f + 1e-6f));
+		const __m128 hit = _mm_and_ps(_mm_and_ps(_mm_cmple_ps(tNear, tFar), _mm_cmpge_ps(tFar, _mm_setzero_ps())), _mm_cmplt_ps(tNear, tBest));
+		return _mm_movemask_ps(hit);
+	}
+};
+
+
+bool BVH::intersectWide(HitInfo& result, const Ray& ray, float tMin, float tMax) const {
+	struct StackEntry {
+		float tNear;
+		int child, count;
+	};
+	StackEntry stack[WideStackSize];
+	int stackSize = 0;
+	stack[stackSize++] = { -FLT_MAX, 0, 0 };
+
+	const WideRay wideRay(ray);
+	float tBest = tMax;
+	int bestPrim = -1;
+	float bestBeta = 0.0f, bestGamma = 0.0f;
+	TriangleMailbox mailbox;
+	const bool duplicates = hasDuplicates();
+	while (stackSize > 0) {
+		const StackEntry entry = stack[--stackSize];
+		if (!(entry.tNear < tBest)) continue;
+
+		if (entry.count > 0) {
+			for (int i = 0; i < entry.count; ++i) {
+				const int prim = this->primIndices[entry.child + i];
+				if (duplicates && mailbox.visited(prim)) continue;
+				float t, beta, gamma;
+				if (triangleMesh->intersectTriangle(ray, triangleMesh->triangles[prim], tMin, tBest, t, beta, gamma)) {
+					tBest = t;
+					bestPrim = prim;
+					bestBeta = beta;
+					bestGamma = gamma;
+				}
+			}
+			continue;
+		}
+
+		const WideBVHNode& current = this->wideNodes[entry.child];
+		__m128 tNear4;
+		const int mask = wideRay.intersect(current, _mm_set1_ps(tBest), tNear4);
+		if (mask == 0) continue;
+		alignas(16) float tNear[4];
+		_mm_store_ps(tNear, tNear4);
+
+		// sort the children that are hit by distance, then push the farthest first
+		int order[4], orderNum = 0;
+		for (int i = 0; i < 4; i++) {
+			if (!(mask & (1 << i))) continue;
+			int k = orderNum++;
+			while ((k > 0) && (tNear[order[k - 1]] < tNear[i])) {
+				order[k] = order[k - 1];
+				k--;
+			}
+			order[k] = i;
+		}
+		for (int k = 0; k < orderNum; k++) {
+			const int i = order[k];
+			stack[stackSize++] = { tNear[i], current.child[i], current.count[i] };
+		}
+	}
+
+	if (bestPrim < 0) return false;
+	triangleMesh->fillHitInfo(result, ray, triangleMesh->triangles[bestPrim], tBest, bestBeta, bestGamma);
+	return true;
+}
+
+
+bool BVH::occludedWide(const Ray& ray, float tMin, float tMax, bool cullBackFaces) const {
+	int stack[WideStackSize][2];
+	int stackSize = 0;
+	stack[stackSize][0] = 0;
+	stack[stackSize++][1] = 0;
+
+	// any hit will do, so the children are not sorted
+	const WideRay wideRay(ray);
+	const __m128 tBest = _mm_set1_ps(tMax);
+	TriangleMailbox mailbox;
+	const bool duplicates = hasDuplicates();
+	while (stackSize > 0) {
+		--stackSize;
+		const int child = stack[stackSize][0], count = stack[stackSize][1];
+		if (count > 0) {
+			for (int i = 0; i < count; ++i) {
+				const int prim = this->primIndices[child + i];
+				if (duplicates && mailbox.visited(prim)) continue;
+				if (triangleMesh->occludeTriangle(ray, triangleMesh->triangles[prim], tMin, tMax, cullBackFaces)) return true;
+			}
+			continue;
+		}
+
+		const WideBVHNode& current = this->wideNodes[child];
+		__m128 tNear;
+		const int mask = wideRay.intersect(current, tBest, tNear);
+		for (int i = 0; i < 4; i++) {
+			if (!(mask & (1 << i))) continue;
+			stack[stackSize][0] = current.child[i];
+			stack[stackSize++][1] = current.count[i];
+		}
+	}
+	return false;
+}
+#endif
 
 
 
@@ -1734,7 +3976,7 @@ public:
 	ParticleSystem() {};
 
 	void updateMesh() {
-		// you can optionally update the other mesh information (e.g., bounding box, BVH - which is tricky)
+		// the bounding box and the BVH are updated by updateFrameState() once the mesh is marked dirty
 		if (sphereSize > 0) {
 			const int n = int(sphere.triangles.size());
 			for (int i = 0; i < globalNumParticles; i++) {
@@ -1789,6 +4031,7 @@ public:
 			particles[i].step();
 		}
 		updateMesh();
+		particlesMesh.dirty = true;
 	}
 };
 static ParticleSystem globalParticleSystem;
@@ -1796,6 +4039,289 @@ static ParticleSystem globalParticleSystem;
 
 
 
+// screen-space tile for the parallel ray tracer (pixels in [x0, x1) x [y0, y1))
+struct RenderTile {
+	int x0, y0, x1, y1;
+};
+
+
+// per-thread scratch state of the parallel ray tracer
+// (each worker only ever touches its own context, so no locking is needed)
+struct RenderThreadContext {
+	int id = 0;
+	int tilesRendered = 0;
+	int tilesStolen = 0;
+	long long pixelsRendered = 0;
+	double busyTime = 0.0; // ms
+};
+
+
+// interleave the bits of x and y (Z-order curve)
+static uint32_t mortonEncode2D(uint32_t x, uint32_t y) {
+	auto part1By1 = [](uint32_t v) -> uint32_t {
+		v &= 0x0000ffff;
+		v = (v | (v << 8)) & 0x00ff00ff;
+		v = (v | (v << 4)) & 0x0f0f0f0f;
+		v = (v | (v << 2)) & 0x33333333;
+		v = (v | (v << 1)) & 0x55555555;
+		return v;
+	};
+	return part1By1(x) | (part1By1(y) << 1);
+}
+
+
+// work-stealing tile scheduler
+// tiles are sorted along a Morton curve and every worker gets a contiguous run of them,
+// so neighbouring tiles (which touch the same part of the BVH) are rendered by the same thread.
+// a worker takes tiles from the front of its own queue and, once it is empty,
+// steals from the back of the other queues.
+class TileScheduler {
+public:
+	std::vector<RenderTile> tiles;
+
+	TileScheduler(const int width, const int height, const int tileSize, const int numWorkers) : queues(numWorkers) {
+		const int numTilesX = (width + tileSize - 1) / tileSize;
+		const int numTilesY = (height + tileSize - 1) / tileSize;
+
+		std::vector<std::pair<uint32_t, int>> order;
+		for (int ty = 0; ty < numTilesY; ty++) {
+			for (int tx = 0; tx < numTilesX; tx++) {
+				RenderTile tile;
+				tile.x0 = tx * tileSize;
+				tile.y0 = ty * tileSize;
+				tile.x1 = std::min(tile.x0 + tileSize, width);
+				tile.y1 = std::min(tile.y0 + tileSize, height);
+				order.push_back(std::make_pair(mortonEncode2D(tx, ty), int(tiles.size())));
+				tiles.push_back(tile);
+			}
+		}
+		std::sort(order.begin(), order.end());
+
+		const int numTiles = int(order.size());
+		for (int w = 0; w < numWorkers; w++) {
+			const int first = int((long long)numTiles * w / numWorkers);
+			const int last = int((long long)numTiles * (w + 1) / numWorkers);
+			for (int k = first; k < last; k++) {
+				queues[w].tiles.push_back(order[k].second);
+			}
+		}
+	}
+
+	// fetch the next tile for a worker, returns false once all the tiles are taken
+	bool next(const int worker, RenderTile& tile, bool& stolen) {
+		const int numWorkers = int(queues.size());
+		for (int k = 0; k < numWorkers; k++) {
+			WorkQueue& queue = queues[(worker + k) % numWorkers];
+			std::lock_guard<std::mutex> guard(queue.lock);
+			if (queue.tiles.empty()) continue;
+
+			int id;
+			if (k == 0) {
+				id = queue.tiles.front();
+				queue.tiles.pop_front();
+			} else {
+				id = queue.tiles.back();
+				queue.tiles.pop_back();
+			}
+			tile = tiles[id];
+			stolen = (k != 0);
+			return true;
+		}
+		return false;
+	}
+
+private:
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<int> tiles;
+	};
+	std::vector<WorkQueue> queues;
+};
+
+
+
+
+
+
+
+
+// G-buffer (ray tracing)
+// the shading record of every eye ray from the last full-resolution frame. for a diffuse surface that is simply
+// the first hit (position, normal, material and texture coordinate); behind mirrors and glass it is the surface
+// that the specular bounces end at. as long as the camera, the resolution and the geometry stay the same,
+// a change to the lights only needs to shade these surfaces again (shadow rays only, no eye or bounce rays).
+class GBuffer {
+public:
+	std::vector<ShadingRecord> records;
+	std::vector<PointLightSource> lights; // the lights the frame was shaded with
+	CameraState camera;
+	int width = 0, height = 0;
+	bool valid = false;
+
+	void resize(const int newWidth, const int newHeight) {
+		records.resize(newWidth * newHeight);
+		width = newWidth;
+		height = newHeight;
+		valid = false;
+	}
+};
+static GBuffer globalGBuffer;
+
+
+
+// temporal reprojection cache
+// the primary hit and the radiance of each pixel are kept from frame to frame. when the camera moves,
+// the cached hits are projected into the new view and only the pixels that nothing lands on are traced again.
+// only hits on Lambertian surfaces are cached, since their shading does not depend on the view direction.
+class ReprojectionCache {
+public:
+	enum { NotCached = 255 };
+
+	std::vector<float3> positions; // world-space primary hit
+	std::vector<float3> radiance;
+	std::vector<unsigned char> ages; // frames since the pixel was traced (NotCached = nothing to reuse)
+	int width = 0, height = 0;
+	bool valid = false;
+
+	void resize(const int newWidth, const int newHeight) {
+		positions.resize(newWidth * newHeight);
+		radiance.resize(newWidth * newHeight);
+		ages.assign(newWidth * newHeight, NotCached);
+		width = newWidth;
+		height = newHeight;
+		valid = false;
+	}
+};
+static ReprojectionCache globalReprojectionCache;
+
+
+
+
+// a placement of a mesh in the scene: its rays are transformed into the object space of the mesh, so every
+// instance shares the one BVH of the mesh
+class Instance {
+public:
+	int object = 0; // index into Scene::objects
+	bool transformed = false; // false: the mesh is where it was loaded (objectToWorld is the identity)
+	float4x4 objectToWorld = linalg::identity, worldToObject = linalg::identity;
+	float3x3 normalToWorld = linalg::identity;
+	AABB bbox; // world space, set by Scene::updateInstances
+
+	Instance() {}
+	Instance(const int object, const float4x4& m) : object(object), objectToWorld(m), worldToObject(inverse(m)), normalToWorld(TriangleMesh::normalMatrix(m)) {
+		transformed = (m != float4x4(linalg::identity));
+	}
+
+	Ray toObject(const Ray& ray) const {
+		// the direction is not normalized, so that the hit distances are the same in both spaces
+		return Ray(mul(worldToObject, float4(ray.o, 1.0f)).xyz(), mul(worldToObject, float4(ray.d, 0.0f)).xyz());
+	}
+	void toWorld(HitInfo& hit, const Ray& ray) const {
+		hit.P = ray.o + hit.t * ray.d;
+		hit.N = normalize(mul(normalToWorld, hit.N));
+		hit.N_g = normalize(mul(normalToWorld, hit.N_g));
+	}
+};
+
+
+// top-level BVH over the world-space boxes of the instances, in the FlatBVHNode layout with instance indices
+// in its leaves. it is rebuilt whenever a box changes, which is cheap next to the meshes (median splits)
+class InstanceBVH {
+public:
+	static constexpr int LeafSize = 2;
+	static constexpr int StackSize = 64; // median splits keep the depth at about log2 of the number of instances
+
+	int nodeNum = 0;
+	std::vector<int> instanceIndices;
+
+	void build(const std::vector<Instance>& instances) {
+		instanceIndices.clear();
+		for (int i = 0; i < int(instances.size()); i++) {
+			// (the instances of empty meshes are left out)
+			if (instances[i].bbox.get_minp().x <= instances[i].bbox.get_maxp().x) instanceIndices.push_back(i);
+		}
+		const int n = int(instanceIndices.size());
+		nodeStorage.assign(std::max(2 * n - 1, 0) * sizeof(FlatBVHNode) + 64, 0);
+		nodes = (FlatBVHNode*)(nodeStorage.data() + ((64 - (uintptr_t)nodeStorage.data() % 64) % 64));
+		nodeNum = 0;
+		if (n > 0) buildNode(instances, 0, n);
+	}
+
+	// visits the instances whose boxes the ray enters before tMax, the nearest box first. visit(instance, tMax)
+	// may shorten tMax (closest hit), or return true to end the traversal (any hit)
+	template <typename Func>
+	void traverse(const Ray& ray, float tMax, const Func& visit) const {
+		float tNear;
+		if ((nodeNum == 0) || !nodes[0].bbox.intersect(tNear, ray) || (tNear > tMax)) return;
+		struct StackEntry {
+			int node;
+			float tNear;
+		};
+		StackEntry stack[StackSize];
+		int stackSize = 0;
+		stack[stackSize++] = { 0, tNear };
+		while (stackSize > 0) {
+			const StackEntry entry = stack[--stackSize];
+			if (entry.tNear > tMax) continue;
+			const FlatBVHNode& current = nodes[entry.node];
+			if (current.isLeaf()) {
+				for (int i = 0; i < current.count; i++) {
+					if (visit(instanceIndices[current.offset + i], tMax)) return;
+				}
+				continue;
+			}
+			const int idLeft = entry.node + 1, idRight = current.offset;
+			float tLeft, tRight;
+			const bool hitLeft = nodes[idLeft].bbox.intersect(tLeft, ray) && (tLeft <= tMax);
+			const bool hitRight = nodes[idRight].bbox.intersect(tRight, ray) && (tRight <= tMax);
+			if (hitLeft && hitRight) {
+				if (tLeft <= tRight) {
+					stack[stackSize++] = { idRight, tRight };
+					stack[stackSize++] = { idLeft, tLeft };
+				} else {
+					stack[stackSize++] = { idLeft, tLeft };
+					stack[stackSize++] = { idRight, tRight };
+				}
+			} else if (hitLeft) {
+				stack[stackSize++] = { idLeft, tLeft };
+			} else if (hitRight) {
+				stack[stackSize++] = { idRight, tRight };
+			}
+		}
+	}
+
+private:
+	std::vector<unsigned char> nodeStorage;
+	FlatBVHNode* nodes = nullptr;
+
+	int buildNode(const std::vector<Instance>& instances, const int begin, const int end) {
+		const int node_id = nodeNum++;
+		FlatBVHNode& current = *new (&nodes[node_id]) FlatBVHNode();
+		AABB centers;
+		for (int i = begin; i < end; i++) {
+			const AABB& box = instances[instanceIndices[i]].bbox;
+			current.bbox.fit(box);
+			centers.fit(0.5f * (box.get_minp() + box.get_maxp()));
+		}
+		if (end - begin <= LeafSize) {
+			current.offset = begin;
+			current.count = end - begin;
+			return node_id;
+		}
+
+		// split at the median center along the longest axis of the centers
+		const int axis = centers.getLargestAxis();
+		const int mid = (begin + end) / 2;
+		std::nth_element(instanceIndices.begin() + begin, instanceIndices.begin() + mid, instanceIndices.begin() + end, [&](const int a, const int b) {
+			return (instances[a].bbox.get_minp()[axis] + instances[a].bbox.get_maxp()[axis]) < (instances[b].bbox.get_minp()[axis] + instances[b].bbox.get_maxp()[axis]);
+		});
+		current.count = 0;
+		buildNode(instances, begin, mid);
+		const int idRight = buildNode(instances, mid, end);
+		nodes[node_id].offset = idRight;
+		return node_id;
+	}
+};
 
 
 
@@ -1806,20 +4332,91 @@ public:
 	std::vector<TriangleMesh*> objects;
 	std::vector<PointLightSource*> pointLightSources;
 	std::vector<BVH> bvhs;
+	std::vector<Instance> instances;
+	InstanceBVH instanceBVH;
+	bool instancing = false; // see hasInstancing(), updated by updateInstances()
 
+	// adds a mesh with one instance where it is
 	void addObject(TriangleMesh* pObj) {
 		objects.push_back(pObj);
+		instances.push_back(Instance(int(objects.size()) - 1, linalg::identity));
+	}
+	// adds a mesh without placing it (see addInstance), returns its index
+	int addMesh(TriangleMesh* pObj) {
+		objects.push_back(pObj);
+		return int(objects.size()) - 1;
+	}
+	// places objects[object] in the scene once more, transformed by m
+	void addInstance(const int object, const float4x4& m) {
+		instances.push_back(Instance(object, m));
 	}
 	void addLight(PointLightSource* pObj) {
 		pointLightSources.push_back(pObj);
 	}
 
 	void preCalc() {
-		bvhs.resize(objects.size());
 		for (int i = 0; i < objects.size(); i++) {
 			objects[i]->preCalc();
-			bvhs[i].build(objects[i]);
 		}
+		buildBVHs();
+	}
+
+	// the meshes are built concurrently, and the threads that are not needed for that build subtrees
+	void buildBVHs() {
+		bvhs.resize(objects.size());
+		const int numThreads = std::max(1, std::min(globalNumThreads, int(objects.size())));
+		globalBVHBuildThreads = globalNumThreads - numThreads;
+
+		std::atomic<int> next(0);
+		auto worker = [&]() {
+			for (int i = next++; i < int(objects.size()); i = next++) {
+				bvhs[i].build(objects[i]);
+			}
+			// this thread can now help the meshes that are still being built
+			globalBVHBuildThreads++;
+		};
+		std::vector<std::thread> threads;
+		for (int t = 1; t < numThreads; t++) threads.push_back(std::thread(worker));
+		worker();
+		for (std::thread& thread : threads) thread.join();
+		globalBVHBuildThreads = 0;
+		updateInstances();
+	}
+
+	// the world-space boxes of the instances from the boxes of their meshes, and the top-level BVH over them
+	void updateInstances() {
+		instancing = (instances.size() != objects.size());
+		for (Instance& instance : instances) {
+			instancing = instancing || instance.transformed;
+			instance.bbox.reset();
+			const TriangleMesh* mesh = objects[instance.object];
+			if (mesh->triangles.empty()) continue;
+			if (!instance.transformed) {
+				instance.bbox = mesh->bbox;
+				continue;
+			}
+			for (int corner = 0; corner < 8; corner++) {
+				const float3 p = float3((corner & 1) ? mesh->bbox.get_maxp().x : mesh->bbox.get_minp().x,
+					(corner & 2) ? mesh->bbox.get_maxp().y : mesh->bbox.get_minp().y, (corner & 4) ? mesh->bbox.get_maxp().z : mesh->bbox.get_minp().z);
+				instance.bbox.fit(mul(instance.objectToWorld, float4(p, 1.0f)).xyz());
+			}
+		}
+		instanceBVH.build(instances);
+	}
+
+	// the packet paths loop over the meshes, which only works if each of them is placed once where it is
+	// (checked on every shading call, so it is worked out once in updateInstances())
+	bool hasInstancing() const {
+		return instancing;
+	}
+
+	// the geometry of object i has changed (e.g., particles): refit its BVH, or rebuild it with the fast builder
+	// once the refitted tree has become too slow
+	void rebuildBVH(const int i) {
+		objects[i]->preCalc();
+		globalBVHBuildThreads = globalNumThreads - 1;
+		if (!bvhs[i].refit(objects[i])) bvhs[i].build(objects[i], globalDynamicBVHBuilder, false);
+		globalBVHBuildThreads = 0;
 	}
 
 	// Fetch environment map
@@ -1845,18 +4442,98 @@ public:
 		HitInfo tempMinHit;
 		minHit.t = FLT_MAX;
 
-		for (int i = 0, i_n = (int)objects.size(); i < i_n; i++) {
-			//if (objects[i]->bruteforceIntersect(tempMinHit, ray, tMin, tMax)) { // for debugging
-			if (bvhs[i].intersect(tempMinHit, ray, tMin, tMax)) {
+		// the instances whose boxes the ray enters, nearest first (only hits in front of the closest one so far
+		// can replace it)
+		instanceBVH.traverse(ray, tMax, [&](const int i, float& tBest) {
+			const Instance& instance = instances[i];
+			//if (objects[instance.object]->bruteforceIntersect(tempMinHit, ray, tMin, tBest)) { // for debugging
+			if (bvhs[instance.object].intersect(tempMinHit, instance.transformed ? instance.toObject(ray) : ray, tMin, tBest)) {
 				if (tempMinHit.t < minHit.t) {
 					hit = true;
 					minHit = tempMinHit;
+					tBest = minHit.t;
+					if (instance.transformed) instance.toWorld(minHit, ray);
 				}
 			}
-		}
+			return false;
+		});
 		return hit;
 	}
 
+	// shadow ray query: is there anything between tMin and tMax along the ray?
+	bool occluded(const Ray& ray, float tMin, float tMax, bool cullBackFaces = globalCullShadowBackfaces) const {
+		bool blocked = false;
+		instanceBVH.traverse(ray, tMax, [&](const int i, float&) {
+			const Instance& instance = instances[i];
+			blocked = bvhs[instance.object].occluded(instance.transformed ? instance.toObject(ray) : ray, tMin, tMax, cullBackFaces);
+			return blocked;
+		});
+		return blocked;
+	}
+
+	// shadow ray packet: "blocked[k]" tells if anything lies between tMin and tMax[k] along ray k
+	// (only the rays in laneMask are traced)
+	void occludedPacket(bool blocked[4], const Ray rays[4], const float tMin, const float tMax[4], const int laneMask = 0xF, bool cullBackFaces = globalCullShadowBackfaces) const {
+#ifdef CS488_SSE
+		if (hasInstancing()) {
+			for (int k = 0; k < 4; k++) {
+				blocked[k] = (laneMask & (1 << k)) && occluded(rays[k], tMin, tMax[k], cullBackFaces);
+			}
+			return;
+		}
+		const RayPacket packet(rays);
+		const __m128 tMaxs = _mm_setr_ps(tMax[0], tMax[1], tMax[2], tMax[3]);
+		__m128 active = _mm_castsi128_ps(_mm_setr_epi32(-(laneMask & 1), -((laneMask >> 1) & 1), -((laneMask >> 2) & 1), -((laneMask >> 3) & 1)));
+		__m128 hit = _mm_setzero_ps();
+		for (int i = 0, i_n = (int)objects.size(); (i < i_n) && (_mm_movemask_ps(active) != 0); i++) {
+			const __m128 hitObject = bvhs[i].occludedPacket(packet, active, tMin, tMaxs, cullBackFaces);
+			hit = _mm_or_ps(hit, hitObject);
+			active = _mm_andnot_ps(hitObject, active);
+		}
+		const int mask = _mm_movemask_ps(hit);
+		for (int k = 0; k < 4; k++) blocked[k] = (mask & (1 << k)) != 0;
+#else
+		for (int k = 0; k < 4; k++) {
+			blocked[k] = (laneMask & (1 << k)) && occluded(rays[k], tMin, tMax[k], cullBackFaces);
+		}
+#endif
+	}
+
+	// ray packet - scene intersection
+	// returns the closest hit of each ray, "hit[k]" tells if ray k hits anything
+	void intersectPacket(HitInfo minHits[4], bool hit[4], const Ray rays[4]) const {
+#ifdef CS488_SSE
+		const RayPacket packet(rays);
+		PacketHit packetHit;
+		for (int i = 0, i_n = (int)objects.size(); i < i_n; i++) {
+			bvhs[i].intersectPacket(packetHit, packet, i);
+		}
+		for (int k = 0; k < PacketSize; k++) {
+			hit[k] = (packetHit.object[k] >= 0);
+			if (hit[k]) {
+				const TriangleMesh* mesh = objects[packetHit.object[k]];
+				mesh->fillHitInfo(minHits[k], rays[k], mesh->triangles[packetHit.triangle[k]], packetHit.t[k], packetHit.beta[k], packetHit.gamma[k]);
+			}
+		}
+#else
+		for (int k = 0; k < 4; k++) {
+			hit[k] = intersect(minHits[k], rays[k]);
+		}
+#endif
+	}
+
+	bool canTracePackets() const {
+#ifdef CS488_SSE
+		if (!globalPacketTracing || hasInstancing()) return false;
+		for (const BVH& bvh : bvhs) {
+			if (!bvh.supportsPackets()) return false;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
 	// camera -> screen matrix (given to you for A2)
 	float4x4 perspectiveMatrix(float fovy, float aspect, float zNear, float zFar) const {
 		float4x4 m;
@@ -1895,81 +4572,807 @@ public:
 	void Rasterize() const {
 		// ====== implement it in A2 ======
 		// fill in plm by a proper matrix
-		const float4x4 pm = perspectiveMatrix(globalFOV, globalAspectRatio, globalDepthMin, globalDepthMax);
+		const float4x4 pm = perspectiveMatrix(globalFOV, FrameBuffer.aspectRatio(), globalDepthMin, globalDepthMax);
 		const float4x4 lm = lookatMatrix(globalEye, globalLookat, globalUp);
 		const float4x4 plm = mul(pm, lm);
 
 		FrameBuffer.clear();
-		for (int n = 0, n_n = (int)objects.size(); n < n_n; n++) {
-			for (int k = 0, k_n = (int)objects[n]->triangles.size(); k < k_n; k++) {
-				objects[n]->rasterizeTriangle(objects[n]->triangles[k], plm);
+		for (const Instance& instance : instances) {
+			const TriangleMesh* mesh = objects[instance.object];
+			for (int k = 0, k_n = (int)mesh->triangles.size(); k < k_n; k++) {
+				if (instance.transformed) {
+					mesh->rasterizeTriangle(TriangleMesh::transformTriangle(mesh->triangles[k], instance.objectToWorld, instance.normalToWorld), plm, FrameBuffer);
+				} else {
+					mesh->rasterizeTriangle(mesh->triangles[k], plm, FrameBuffer);
+				}
 			}
 		}
 	}
 
+	// camera coordinate system used by eyeRay
+	void cameraBasis(float3& uDir, float3& vDir, float3& wDir) const {
+		wDir = normalize(float3(-globalViewDir));
+		uDir = normalize(cross(globalUp, wDir));
+		vDir = cross(wDir, uDir);
+	}
+
+	// inverse of eyeRay: the (continuous) pixel position of a world-space point in "target" and its depth along the
+	// view direction, returns false if the point is behind the camera
+	bool projectToPixel(const Image& target, const float3& p, float2& pixel, float& depth) const {
+		float3 uDir, vDir, wDir;
+		cameraBasis(uDir, vDir, wDir);
+
+		const float3 d = p - globalEye;
+		depth = -dot(d, wDir);
+		if (depth <= 0.0f) return false;
+
+		const float scale = globalDistanceToFilm / depth;
+		const float imPlaneUPos = dot(d, uDir) * scale / (target.aspectRatio() * globalFilmSize);
+		const float imPlaneVPos = dot(d, vDir) * scale / globalFilmSize;
+		pixel = float2((imPlaneUPos + 0.5f) * float(target.width), (imPlaneVPos + 0.5f) * float(target.height));
+		return true;
+	}
+
 	// eye ray generation (given to you for A1)
-	Ray eyeRay(int x, int y) const {
+	// "jitter" is the position of the sample within the pixel (0.5 = pixel center) of "target"
+	Ray eyeRay(const Image& target, int x, int y, const float2& jitter = float2(0.5f)) const {
 		// compute the camera coordinate system 
-		const float3 wDir = normalize(float3(-globalViewDir));
-		const float3 uDir = normalize(cross(globalUp, wDir));
-		const float3 vDir = cross(wDir, uDir);
+		float3 uDir, vDir, wDir;
+		cameraBasis(uDir, vDir, wDir);
 
 		// compute the pixel location in the world coordinate system using the camera coordinate system
-		// trace a ray through the center of each pixel
-		const float imPlaneUPos = (x + 0.5f) / float(globalWidth) - 0.5f;
-		const float imPlaneVPos = (y + 0.5f) / float(globalHeight) - 0.5f;
+		// trace a ray through the sample position within each pixel
+		const float imPlaneUPos = (x + jitter.x) / float(target.width) - 0.5f;
+		const float imPlaneVPos = (y + jitter.y) / float(target.height) - 0.5f;
 
-		const float3 pixelPos = globalEye + float(globalAspectRatio * globalFilmSize * imPlaneUPos) * uDir + float(globalFilmSize * imPlaneVPos) * vDir - globalDistanceToFilm * wDir;
+		const float3 pixelPos = globalEye + float(target.aspectRatio() * globalFilmSize * imPlaneUPos) * uDir + float(globalFilmSize * imPlaneVPos) * vDir - globalDistanceToFilm * wDir;
 
 		return Ray(globalEye, normalize(pixelPos - globalEye));
 	}
 
+	// radiance along the eye ray through pixel (i, j)
+	// "record" optionally receives the light-independent part of the path (see shade)
+	float3 tracePixel(const int i, const int j, const float2& jitter = float2(0.5f), ShadingRecord* record = nullptr) const {
+		const Ray ray = eyeRay(FrameBuffer, i, j, jitter);
+		HitInfo hitInfo;
+		if (intersect(hitInfo, ray)) {
+			return shade(hitInfo, -ray.d, 0, record);
+		}
+		const float3 L = EnvironMap.loaded ? getEnvironment(ray.d) : float3(0.0f);
+		if (record) {
+			record->hit.material = nullptr;
+			record->radiance = L;
+		}
+		return L;
+	}
+
+	// radiance of a 2x2 block of pixels starting at (i, j), optionally with the eye rays traced as one packet
+	// (pixels outside the tile are traced as duplicates in a packet and must not be written)
+	// "laneMask" selects the pixels that are needed, a partial quad is traced one ray at a time
+	// "records" optionally receives the paths as in tracePixel
+	void tracePixelQuad(float3 L[4], const int i, const int j, const RenderTile& tile, const float2 jitter[4], const bool usePackets, const int laneMask = 0xF, ShadingRecord* records = nullptr) const {
+		const bool fullQuad = (i + 1 < tile.x1) && (j + 1 < tile.y1) && (laneMask == 0xF);
+		if (!usePackets || !fullQuad) {
+			for (int k = 0; k < 4; k++) {
+				const int x = i + (k & 1);
+				const int y = j + (k >> 1);
+				if ((laneMask & (1 << k)) && (x < tile.x1) && (y < tile.y1)) L[k] = tracePixel(x, y, jitter[k], records ? &records[k] : nullptr);
+			}
+			return;
+		}
+
+		Ray rays[4];
+		for (int k = 0; k < 4; k++) {
+			const int x = std::min(i + (k & 1), tile.x1 - 1);
+			const int y = std::min(j + (k >> 1), tile.y1 - 1);
+			rays[k] = eyeRay(FrameBuffer, x, y, jitter[k]);
+		}
+
+		HitInfo hitInfos[4];
+		bool hits[4];
+		intersectPacket(hitInfos, hits, rays);
+		for (int k = 0; k < 4; k++) {
+			if (hits[k]) {
+				L[k] = shade(hitInfos[k], -rays[k].d, 0, records ? &records[k] : nullptr);
+				continue;
+			}
+			L[k] = EnvironMap.loaded ? getEnvironment(rays[k].d) : float3(0.0f);
+			if (records) {
+				records[k].hit.material = nullptr;
+				records[k].radiance = L[k];
+			}
+		}
+	}
+
+	// run "func" over all the tiles of the frame on globalNumThreads threads
+	// the calling thread works as thread 0 so that it can keep on using OpenGL
+	// with a "deadline", the threads stop taking new tiles once it has passed
+	void renderTiles(const int width, const int height, const std::function<void(const RenderTile&, RenderThreadContext&)>& func, std::vector<RenderThreadContext>& contexts,
+		const std::chrono::high_resolution_clock::time_point* deadline = nullptr) const {
+		const int numThreads = std::max(1, globalNumThreads);
+		TileScheduler scheduler(width, height, globalTileSize, numThreads);
+
+		contexts.assign(numThreads, RenderThreadContext());
+		for (int t = 0; t < numThreads; t++) {
+			contexts[t].id = t;
+		}
+
+		const int numTiles = int(scheduler.tiles.size());
+		auto worker = [&](RenderThreadContext& context) {
+			RenderTile tile;
+			bool stolen;
+			while (scheduler.next(context.id, tile, stolen)) {
+				if (deadline && (std::chrono::high_resolution_clock::now() >= *deadline)) break;
+
+				auto tileStart = std::chrono::high_resolution_clock::now();
+				func(tile, context);
+				auto tileEnd = std::chrono::high_resolution_clock::now();
+
+				context.busyTime += std::chrono::duration<double, std::milli>(tileEnd - tileStart).count();
+				context.tilesRendered++;
+				if (stolen) context.tilesStolen++;
+				context.pixelsRendered += (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+
+				// show intermediate process
+				if (globalShowRaytraceProgress && (context.id == 0)) {
+#ifndef CS488_HEADLESS
+					glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, FrameBuffer.width, FrameBuffer.height, GL_RGB, GL_FLOAT, &FrameBuffer.pixels[0]);
+					glRecti(1, 1, -1, -1);
+					glfwSwapBuffers(globalGLFWindow);
+#endif
+					printf("Rendering Progress: %.3f%%\r", context.tilesRendered / float(numTiles) * 100.0f);
+					fflush(stdout);
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		for (int t = 1; t < numThreads; t++) {
+			threads.push_back(std::thread(worker, std::ref(contexts[t])));
+		}
+		worker(contexts[0]);
+		for (auto& thread : threads) thread.join();
+	}
+
+	// per-thread breakdown of the last frame
+	void reportThreadStats(const std::vector<RenderThreadContext>& contexts) const {
+		if (!globalShowThreadStats || contexts.size() <= 1) return;
+		for (const auto& context : contexts) {
+			printf("  thread %2d: %4d tiles (%3d stolen), %8lld pixels, %8.1f ms busy\n", context.id, context.tilesRendered, context.tilesStolen, context.pixelsRendered, context.busyTime);
+		}
+	}
+
+	// deadline-bounded ray tracing
+	// the frame is traced in passes of decreasing block size (8x8, 4x4, 2x2, 1x1): each pass traces one pixel per block
+	// that no earlier pass has traced and fills the block with it. the deadline is checked before every tile,
+	// so an unfinished pass leaves the coarser result of the previous pass (or the previous frame) on screen.
+	// returns the fraction of the frame that got to full resolution
+	float RaytraceCoarseToFine(const std::chrono::high_resolution_clock::time_point& deadline, std::vector<RenderThreadContext>& contexts) const {
+		const int numTiles = ((FrameBuffer.width + globalTileSize - 1) / globalTileSize) * ((FrameBuffer.height + globalTileSize - 1) / globalTileSize);
+		int tilesDone = 0;
+
+		for (int block = globalCoarsestBlock; block >= 1; block /= 2) {
+			std::vector<RenderThreadContext> passContexts;
+			renderTiles(FrameBuffer.width, FrameBuffer.height, [this, block](const RenderTile& tile, RenderThreadContext& context) {
+				for (int j = tile.y0; j < tile.y1; j += block) {
+					for (int i = tile.x0; i < tile.x1; i += block) {
+						// already traced by a coarser pass
+						if ((block < globalCoarsestBlock) && ((i % (2 * block)) == 0) && ((j % (2 * block)) == 0)) continue;
+
+						const float3 L = tracePixel(i, j);
+						for (int y = j, y_n = std::min(j + block, tile.y1); y < y_n; y++) {
+							for (int x = i, x_n = std::min(i + block, tile.x1); x < x_n; x++) {
+								FrameBuffer.pixel(x, y) = L;
+							}
+						}
+					}
+				}
+			}, passContexts, &deadline);
+
+			tilesDone = 0;
+			contexts.resize(passContexts.size());
+			for (int t = 0; t < int(passContexts.size()); t++) {
+				contexts[t].id = t;
+				contexts[t].tilesRendered += passContexts[t].tilesRendered;
+				contexts[t].tilesStolen += passContexts[t].tilesStolen;
+				contexts[t].pixelsRendered += passContexts[t].pixelsRendered;
+				contexts[t].busyTime += passContexts[t].busyTime;
+				tilesDone += passContexts[t].tilesRendered;
+			}
+			if (tilesDone < numTiles) {
+				printf("Deadline reached in the %dx%d pass (%.1f%% of its tiles done)\n", block, block, 100.0f * tilesDone / float(numTiles));
+				return (block == 1) ? tilesDone / float(numTiles) : 0.0f;
+			}
+		}
+		return 1.0f;
+	}
+
+	// low-resolution preview: one eye ray through the center of every block x block pixels,
+	// bilinearly upsampled to the full frame
+	void RaytracePreview(const int block, std::vector<RenderThreadContext>& contexts) const {
+		static Image PreviewBuffer;
+		const int previewWidth = (FrameBuffer.width + block - 1) / block;
+		const int previewHeight = (FrameBuffer.height + block - 1) / block;
+		if ((PreviewBuffer.width != previewWidth) || (PreviewBuffer.height != previewHeight)) {
+			PreviewBuffer.resize(previewWidth, previewHeight);
+		}
+
+		renderTiles(previewWidth, previewHeight, [this, block](const RenderTile& tile, RenderThreadContext& context) {
+			for (int j = tile.y0; j < tile.y1; ++j) {
+				for (int i = tile.x0; i < tile.x1; ++i) {
+					PreviewBuffer.pixel(i, j) = tracePixel(i * block, j * block, float2(0.5f * block));
+				}
+			}
+		}, contexts);
+
+		std::vector<RenderThreadContext> upsampleContexts;
+		renderTiles(FrameBuffer.width, FrameBuffer.height, [block](const RenderTile& tile, RenderThreadContext& context) {
+			const float invBlock = 1.0f / float(block);
+			for (int j = tile.y0; j < tile.y1; ++j) {
+				const float v = std::max(0.0f, (j + 0.5f) * invBlock - 0.5f);
+				const int y0 = std::min(int(v), PreviewBuffer.height - 1);
+				const int y1 = std::min(y0 + 1, PreviewBuffer.height - 1);
+				const float fy = v - float(int(v));
+				for (int i = tile.x0; i < tile.x1; ++i) {
+					const float u = std::max(0.0f, (i + 0.5f) * invBlock - 0.5f);
+					const int x0 = std::min(int(u), PreviewBuffer.width - 1);
+					const int x1 = std::min(x0 + 1, PreviewBuffer.width - 1);
+					const float fx = u - float(int(u));
+					const float3 top = linalg::lerp(PreviewBuffer.pixel(x0, y0), PreviewBuffer.pixel(x1, y0), fx);
+					const float3 bottom = linalg::lerp(PreviewBuffer.pixel(x0, y1), PreviewBuffer.pixel(x1, y1), fx);
+					FrameBuffer.pixel(i, j) = linalg::lerp(top, bottom, fy);
+				}
+			}
+		}, upsampleContexts);
+	}
+
+	// copies of the current light sources (to detect edits)
+	std::vector<PointLightSource> lightState() const {
+		std::vector<PointLightSource> lights;
+		lights.reserve(pointLightSources.size());
+		for (const auto* light : pointLightSources) lights.push_back(*light);
+		return lights;
+	}
+
+	// direct lighting of up to four G-buffer surfaces, with the shadow rays toward each light traced as a packet
+	// (gives the same result as shadeSurface)
+	void relightQuad(float3 L[4], const ShadingRecord* const records[4], const int laneMask, const bool usePackets) const {
+#ifdef LAMBERTIAN_SHADOW
+		if (usePackets) {
+			for (int k = 0; k < 4; k++) L[k] = float3(0.0f);
+			for (int l = 0, l_n = (int)pointLightSources.size(); l < l_n; l++) {
+				Ray shadowRays[4];
+				float distances[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+				for (int k = 0; k < 4; k++) {
+					if (laneMask & (1 << k)) distances[k] = lightShadowRay(records[k]->hit, l, shadowRays[k]);
+				}
+				bool blocked[4];
+				occludedPacket(blocked, shadowRays, miniEps, distances, laneMask);
+				for (int k = 0; k < 4; k++) {
+					if ((laneMask & (1 << k)) && !blocked[k]) L[k] += lightContribution(records[k]->hit, records[k]->viewDir, l);
+				}
+			}
+			return;
+		}
+#endif
+		for (int k = 0; k < 4; k++) {
+			if (laneMask & (1 << k)) L[k] = shadeSurface(records[k]->hit, records[k]->viewDir, records[k]->level);
+		}
+	}
+
+	// true if the G-buffer still describes what the eye rays would hit, but the lights have changed since
+	bool canRelight() const {
+		const GBuffer& gbuffer = globalGBuffer;
+		return gbuffer.valid
+			&& (gbuffer.width == FrameBuffer.width) && (gbuffer.height == FrameBuffer.height)
+			&& (gbuffer.camera == CameraState::current()) && (gbuffer.lights != lightState());
+	}
+
+	// shade the G-buffer with the current lights (only shadow rays are traced)
+	void Relight(const bool usePackets, std::vector<RenderThreadContext>& contexts) const {
+		renderTiles(FrameBuffer.width, FrameBuffer.height, [this, usePackets](const RenderTile& tile, RenderThreadContext& context) {
+			const GBuffer& gbuffer = globalGBuffer;
+			for (int j = tile.y0; j < tile.y1; j += 2) {
+				for (int i = tile.x0; i < tile.x1; i += 2) {
+					const ShadingRecord* records[4] = {};
+					int laneMask = 0;
+					for (int k = 0; k < 4; k++) {
+						const int x = i + (k & 1);
+						const int y = j + (k >> 1);
+						if ((x >= tile.x1) || (y >= tile.y1)) continue;
+						records[k] = &gbuffer.records[x + y * gbuffer.width];
+						if (records[k]->hit.material) {
+							laneMask |= (1 << k);
+						} else {
+							FrameBuffer.pixel(x, y) = records[k]->radiance;
+						}
+					}
+					if (laneMask == 0) continue;
+
+					float3 L[4];
+					relightQuad(L, records, laneMask, usePackets);
+					for (int k = 0; k < 4; k++) {
+						if (laneMask & (1 << k)) FrameBuffer.pixel(i + (k & 1), j + (k >> 1)) = records[k]->throughput * L[k];
+					}
+				}
+			}
+		}, contexts);
+		globalGBuffer.lights = lightState();
+	}
+
+	// reuse the previous frame where it is still valid and trace everything else
+	// returns the number of pixels that were traced
+	int RaytraceReprojected(const bool usePackets, std::vector<RenderThreadContext>& contexts) const {
+		ReprojectionCache& cache = globalReprojectionCache;
+		static ReprojectionCache next;
+		static std::vector<float> depths;
+		if ((cache.width != FrameBuffer.width) || (cache.height != FrameBuffer.height)) {
+			cache.resize(FrameBuffer.width, FrameBuffer.height);
+		}
+		if ((next.width != FrameBuffer.width) || (next.height != FrameBuffer.height)) {
+			next.resize(FrameBuffer.width, FrameBuffer.height);
+		}
+		std::fill(next.ages.begin(), next.ages.end(), ReprojectionCache::NotCached);
+		depths.assign(FrameBuffer.width * FrameBuffer.height, FLT_MAX);
+
+		// forward-project the cached hits into the new view (the closest one wins)
+		// (an age of NotCached would read as a miss, so the ages stop below it)
+		const int maxAge = std::min(globalReprojectionMaxAge, int(ReprojectionCache::NotCached) - 1);
+		if (cache.valid) {
+			for (int k = 0, k_n = cache.width * cache.height; k < k_n; k++) {
+				if (cache.ages[k] >= maxAge) continue;
+
+				float2 pixel;
+				float depth;
+				if (!projectToPixel(FrameBuffer, cache.positions[k], pixel, depth)) continue;
+				const int x = int(floorf(pixel.x));
+				const int y = int(floorf(pixel.y));
+				if (!FrameBuffer.valid(x, y)) continue;
+
+				const int p = x + y * next.width;
+				if (depth < depths[p]) {
+					depths[p] = depth;
+					next.positions[p] = cache.positions[k];
+					next.radiance[p] = cache.radiance[k];
+					next.ages[p] = cache.ages[k] + 1;
+				}
+			}
+		}
+
+		// a far point can land in a gap between the splats of a closer surface, so anything next to a noticeably closer splat is traced again
+		for (int y = 0; y < next.height; y++) {
+			for (int x = 0; x < next.width; x++) {
+				const int p = x + y * next.width;
+				if (next.ages[p] == ReprojectionCache::NotCached) continue;
+				bool occluded = false;
+				for (int dy = -1; (dy <= 1) && !occluded; dy++) {
+					for (int dx = -1; (dx <= 1) && !occluded; dx++) {
+						if (!FrameBuffer.valid(x + dx, y + dy)) continue;
+						occluded = (depths[(x + dx) + (y + dy) * next.width] < 0.95f * depths[p]);
+					}
+				}
+				if (occluded) next.ages[p] = ReprojectionCache::NotCached;
+			}
+		}
+
+		// trace the disoccluded, expired and uncached pixels
+		renderTiles(FrameBuffer.width, FrameBuffer.height, [this, usePackets](const RenderTile& tile, RenderThreadContext& context) {
+			const float2 centers[4] = { float2(0.5f), float2(0.5f), float2(0.5f), float2(0.5f) };
+			for (int j = tile.y0; j < tile.y1; j += 2) {
+				for (int i = tile.x0; i < tile.x1; i += 2) {
+					int laneMask = 0;
+					for (int k = 0; k < 4; k++) {
+						const int x = i + (k & 1);
+						const int y = j + (k >> 1);
+						if ((x >= tile.x1) || (y >= tile.y1)) continue;
+						const int p = x + y * next.width;
+						if (next.ages[p] == ReprojectionCache::NotCached) {
+							laneMask |= (1 << k);
+						} else {
+							FrameBuffer.pixel(x, y) = next.radiance[p];
+						}
+					}
+					if (laneMask == 0) continue;
+
+					float3 L[4];
+					ShadingRecord records[4];
+					tracePixelQuad(L, i, j, tile, centers, usePackets, laneMask, records);
+					for (int k = 0; k < 4; k++) {
+						if (!(laneMask & (1 << k))) continue;
+						const int x = i + (k & 1);
+						const int y = j + (k >> 1);
+						const int p = x + y * next.width;
+						FrameBuffer.pixel(x, y) = L[k];
+						if (records[k].hit.material && (records[k].level == 0)) {
+							next.positions[p] = records[k].hit.P;
+							next.radiance[p] = L[k];
+							next.ages[p] = 0;
+						}
+					}
+				}
+			}
+		}, contexts);
+
+		std::swap(cache.positions, next.positions);
+		std::swap(cache.radiance, next.radiance);
+		std::swap(cache.ages, next.ages);
+		cache.valid = true;
+
+		int traced = 0;
+		for (int k = 0, k_n = cache.width * cache.height; k < k_n; k++) {
+			if ((cache.ages[k] == 0) || (cache.ages[k] == ReprojectionCache::NotCached)) traced++;
+		}
+		return traced;
+	}
+
+	// the jitters of sample "samples[k]" of the pixels of a 2x2 quad at (i, j)
+	// they only depend on the pixel, the sample index and the frame (not on the thread or on the tile order),
+	// so the same image comes out with any number of threads or processes
+	static void pixelJitter(float2 jitter[4], const int i, const int j, const unsigned int samples[4]) {
+		const uint32_t frame = frameStreamKey();
+		uint32_t keys[4];
+		for (int k = 0; k < 4; k++) {
+			const uint32_t pixel = uint32_t(i + (k & 1)) + uint32_t(j + (k >> 1)) * uint32_t(FrameBuffer.width);
+			keys[k] = PCG32::streamKey(pixel, samples[k], frame);
+		}
+		float x[4], y[4];
+		PCG32::rand4(x, keys, 0);
+		PCG32::rand4(y, keys, 1);
+		for (int k = 0; k < 4; k++) jitter[k] = float2(x[k], y[k]);
+	}
+
+	// ray trace only the pixels in "region", adding "samples" samples per pixel to "sum" and their number to "weights"
+	// (both are laid out over the region, and a single sample goes through the pixel center as in Raytrace)
+	// used by the multi-process renderer in headless.cpp, whose partial results are merged by adding them up
+	void RaytraceRegion(const RenderTile& region, const int samples, std::vector<float3>& sum, std::vector<float>& weights) const {
+		const int regionWidth = region.x1 - region.x0;
+		const int regionHeight = region.y1 - region.y0;
+		sum.assign(regionWidth * regionHeight, float3(0.0f));
+		weights.assign(regionWidth * regionHeight, 0.0f);
+
+		std::vector<RenderThreadContext> contexts;
+		const bool usePackets = canTracePackets();
+		renderTiles(regionWidth, regionHeight, [&](const RenderTile& local, RenderThreadContext&) {
+			const RenderTile tile = { local.x0 + region.x0, local.y0 + region.y0, local.x1 + region.x0, local.y1 + region.y0 };
+			for (int j = tile.y0; j < tile.y1; j += 2) {
+				for (int i = tile.x0; i < tile.x1; i += 2) {
+					for (int s = 0; s < samples; s++) {
+						float2 jitter[4];
+						float3 L[4];
+						if (samples == 1) {
+							for (int k = 0; k < 4; k++) jitter[k] = float2(0.5f);
+						} else {
+							const unsigned int indices[4] = { unsigned(s), unsigned(s), unsigned(s), unsigned(s) };
+							pixelJitter(jitter, i, j, indices);
+						}
+						tracePixelQuad(L, i, j, tile, jitter, usePackets);
+						for (int k = 0; k < 4; k++) {
+							const int x = i + (k & 1);
+							const int y = j + (k >> 1);
+							if ((x >= tile.x1) || (y >= tile.y1)) continue;
+							const int p = (x - region.x0) + (y - region.y0) * regionWidth;
+							sum[p] += L[k];
+							weights[p] += 1.0f;
+						}
+					}
+				}
+			}
+		}, contexts);
+	}
+
 	// ray tracing (you probably don't need to change it in A1)
-	void Raytrace() const {
-		FrameBuffer.clear();
+	// "budget" is the time limit of the frame in ms (see globalFrameBudget)
+	void Raytrace(const float budget = globalFrameBudget) const {
+		// nothing left to refine
+		if (progressiveDone()) {
+			globalFrameComplete = true;
+			return;
+		}
 
 		// start timer
 		auto start = std::chrono::high_resolution_clock::now();
 
-		// loop over all pixels in the image
-		for (int j = 0; j < globalHeight; ++j) {
-			for (int i = 0; i < globalWidth; ++i) {
-				const Ray ray = eyeRay(i, j);
-				HitInfo hitInfo;
-				if (intersect(hitInfo, ray)) {
-					FrameBuffer.pixel(i, j) = shade(hitInfo, -ray.d);
-				} else {
-					if (EnvironMap.loaded) {
-						FrameBuffer.pixel(i, j) = getEnvironment(ray.d);
-					} else {
-						FrameBuffer.pixel(i, j) = float3(0.0f);				
+		std::vector<RenderThreadContext> contexts;
+		const bool usePackets = canTracePackets();
+		const bool cameraMoving = globalCameraStillFrames < globalPreviewSettleFrames;
+		const bool relighting = !globalProgressive && canRelight();
+		const bool reprojecting = !relighting && cameraMoving && globalReprojection && !globalProgressive && (budget <= 0.0f);
+		const bool previewing = !relighting && !reprojecting && cameraMoving && (globalPreviewBlock > 1);
+		if (!reprojecting) globalReprojectionCache.valid = false;
+		if (!relighting) globalGBuffer.valid = false;
+		if (relighting) {
+			// only the lights have changed - the eye rays would hit the same points
+			Relight(usePackets, contexts);
+			globalFrameComplete = true;
+		} else if (reprojecting) {
+			// full resolution, but only the pixels that cannot be reused are traced
+			const int traced = RaytraceReprojected(usePackets, contexts);
+			printf("Reprojection: traced %d of %d pixels (%.1f%%)\n", traced, FrameBuffer.width * FrameBuffer.height, 100.0f * traced / float(FrameBuffer.width * FrameBuffer.height));
+			globalFrameComplete = false;
+		} else if (previewing) {
+			// interactive preview until the camera settles
+			RaytracePreview(globalPreviewBlock, contexts);
+			globalFrameComplete = false;
+		} else if (globalProgressive) {
+			// add a few jittered samples per pixel and show the running mean
+			// (only one sample per frame while the camera is being dragged to keep it responsive)
+			int spp = mouseLeftPressed ? 1 : globalSamplesPerFrame;
+			if (globalTargetSamples > 0) spp = std::min(spp, int(globalTargetSamples - sampleCount));
+
+			renderTiles(FrameBuffer.width, FrameBuffer.height, [this, spp, usePackets](const RenderTile& tile, RenderThreadContext&) {
+				PixelStatistics& stats = AccumulationStats;
+				for (int j = tile.y0; j < tile.y1; j += 2) {
+					for (int i = tile.x0; i < tile.x1; i += 2) {
+						// skip the pixels that have already converged
+						int laneMask = 0;
+						for (int k = 0; k < 4; k++) {
+							const int x = i + (k & 1);
+							const int y = j + (k >> 1);
+							if ((x < tile.x1) && (y < tile.y1) && !stats.converged[x + y * stats.width]) laneMask |= (1 << k);
+						}
+						if (laneMask == 0) continue;
+
+						// each pixel continues its own sequence of samples
+						unsigned int indices[4] = { 0, 0, 0, 0 };
+						for (int k = 0; k < 4; k++) {
+							if (laneMask & (1 << k)) indices[k] = unsigned(stats.counts[(i + (k & 1)) + (j + (k >> 1)) * stats.width]);
+						}
+
+						float3 L[4] = { float3(0.0f), float3(0.0f), float3(0.0f), float3(0.0f) };
+						float squares[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+						for (int s = 0; s < spp; s++) {
+							float2 jitter[4];
+							float3 Ls[4];
+							pixelJitter(jitter, i, j, indices);
+							for (int k = 0; k < 4; k++) indices[k]++;
+							tracePixelQuad(Ls, i, j, tile, jitter, usePackets, laneMask);
+							for (int k = 0; k < 4; k++) {
+								if (!(laneMask & (1 << k))) continue;
+								const float lum = PixelStatistics::luminance(Ls[k]);
+								L[k] += Ls[k];
+								squares[k] += lum * lum;
+							}
+						}
+						for (int k = 0; k < 4; k++) {
+							if (!(laneMask & (1 << k))) continue;
+							const int x = i + (k & 1);
+							const int y = j + (k >> 1);
+							const int p = x + y * stats.width;
+							AccumulationBuffer.pixel(x, y) += L[k];
+							stats.sumSquares[p] += squares[k];
+							stats.counts[p] += spp;
+							if (globalAdaptiveSampling && (stats.counts[p] >= globalAdaptiveMinSamples)) {
+								stats.converged[p] = stats.relativeError(x, y, AccumulationBuffer.pixel(x, y)) < globalAdaptiveThreshold;
+							}
+							resolvePixel(x, y);
+						}
 					}
 				}
+			}, contexts);
+			sampleCount += spp;
+
+			AccumulationStats.convergedNum = int(std::count(AccumulationStats.converged.begin(), AccumulationStats.converged.end(), (unsigned char)1));
+			if (globalShowConvergedMask) resolveAccumulation();
+			globalFrameComplete = progressiveDone();
+		} else if (budget > 0.0f) {
+			// keep the previous frame around for the parts that the deadline does not let us reach
+			const auto deadline = start + std::chrono::microseconds((long long)(budget * 1000.0f));
+			const float refined = RaytraceCoarseToFine(deadline, contexts);
+			printf("Frame budget %.0f ms: %.1f%% of the frame refined to full resolution\n", budget, 100.0f * refined);
+			globalFrameComplete = (refined >= 1.0f);
+		} else {
+			FrameBuffer.clear();
+			if ((globalGBuffer.width != FrameBuffer.width) || (globalGBuffer.height != FrameBuffer.height)) {
+				globalGBuffer.resize(FrameBuffer.width, FrameBuffer.height);
 			}
 
-			// show intermediate process
-			if (globalShowRaytraceProgress) {
-				constexpr int scanlineNum = 64;
-				if ((j % scanlineNum) == (scanlineNum - 1)) {
-					glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, globalWidth, globalHeight, GL_RGB, GL_FLOAT, &FrameBuffer.pixels[0]);
-					glRecti(1, 1, -1, -1);
-					glfwSwapBuffers(globalGLFWindow);
-					printf("Rendering Progress: %.3f%%\r", j / float(globalHeight - 1) * 100.0f);
-					fflush(stdout);
+			// loop over all pixels in the image, one tile at a time (keeping the first hits for relighting)
+			renderTiles(FrameBuffer.width, FrameBuffer.height, [this, usePackets](const RenderTile& tile, RenderThreadContext& context) {
+				GBuffer& gbuffer = globalGBuffer;
+				const float2 centers[4] = { float2(0.5f), float2(0.5f), float2(0.5f), float2(0.5f) };
+				for (int j = tile.y0; j < tile.y1; j += 2) {
+					for (int i = tile.x0; i < tile.x1; i += 2) {
+						float3 L[4];
+						ShadingRecord records[4];
+						tracePixelQuad(L, i, j, tile, centers, usePackets, 0xF, records);
+						for (int k = 0; k < 4; k++) {
+							const int x = i + (k & 1);
+							const int y = j + (k >> 1);
+							if ((x < tile.x1) && (y < tile.y1)) {
+								FrameBuffer.pixel(x, y) = L[k];
+								gbuffer.records[x + y * gbuffer.width] = records[k];
+							}
+						}
+					}
 				}
-			}
+			}, contexts);
+
+			globalGBuffer.lights = lightState();
+			globalGBuffer.camera = CameraState::current();
+			globalGBuffer.valid = true;
+			globalFrameComplete = true;
 		}
+
+		if (!globalShowRenderTime) return;
+
 		// end timer
 		 auto end = std::chrono::high_resolution_clock::now();
 		// report speedup
 		 auto elapsed_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-		 std::cout << "Render time: " << elapsed_time.count() << " ms\n";
+		 std::cout << "Render time: " << elapsed_time.count() << " ms (" << contexts.size() << " threads)";
+		 if (relighting) {
+			 std::cout << ", relit from the G-buffer";
+		 } else if (previewing) {
+			 std::cout << ", " << globalPreviewBlock << "x" << globalPreviewBlock << " preview";
+		 } else if (globalProgressive) {
+			 std::cout << ", " << sampleCount << " samples per pixel";
+			 if (globalAdaptiveSampling) std::cout << ", " << (100.0f * AccumulationStats.convergedNum) / float(AccumulationStats.width * AccumulationStats.height) << "% converged";
+			 if (progressiveDone()) std::cout << " (done)";
+		 }
+		 std::cout << "\n";
+		 reportThreadStats(contexts);
 	}
 
 };
 
 static Scene globalScene;
 
+
+// move the first light source (if any)
+static void moveLight(const float3& offset) {
+	if (globalScene.pointLightSources.empty()) return;
+	globalScene.pointLightSources[0]->position += offset;
+	resetAccumulation();
+}
+
+
+// rebuild the BVHs with globalBVHBuilder
+static void rebuildBVHs() {
+	globalScene.buildBVHs();
+	resetAccumulation();
+}
+
+
+// everything outside of the render settings that the image depends on
+class FrameState {
+public:
+	CameraState camera;
+	std::vector<PointLightSource> lights;
+	int width = 0, height = 0;
+	enumRenderType renderType = RENDER_IMAGE;
+
+	static FrameState current() {
+		FrameState state;
+		state.camera = CameraState::current();
+		state.lights = globalScene.lightState();
+		state.width = FrameBuffer.width;
+		state.height = FrameBuffer.height;
+		state.renderType = globalRenderType;
+		return state;
+	}
+
+	bool operator==(const FrameState& other) const {
+		return (camera == other.camera) && (lights == other.lights) && (width == other.width) && (height == other.height) && (renderType == other.renderType);
+	}
+	bool operator!=(const FrameState& other) const {
+		return !(*this == other);
+	}
+};
+static FrameState globalLastFrameState;
+
+// compares the scene against the last frame and clears the dirty flags of the objects
+// returns true if the image has to be rendered again
+static bool updateFrameState() {
+	bool geometryChanged = false;
+	for (int i = 0, i_n = (int)globalScene.objects.size(); i < i_n; i++) {
+		TriangleMesh* object = globalScene.objects[i];
+		if (!object->dirty) continue;
+		if (i < (int)globalScene.bvhs.size()) globalScene.rebuildBVH(i);
+		geometryChanged = true;
+		object->dirty = false;
+	}
+	if (geometryChanged) {
+		globalScene.updateInstances();
+
+		// the cached hits no longer describe the scene
+		globalGBuffer.valid = false;
+		globalReprojectionCache.valid = false;
+	}
+
+	const FrameState state = FrameState::current();
+	const bool changed = geometryChanged || (state != globalLastFrameState);
+
+	// the cached radiance was lit by the old lights
+	if (state.lights != globalLastFrameState.lights) globalReprojectionCache.valid = false;
+	if (changed && (globalRenderType == RENDER_RAYTRACE) && (globalLastFrameState.renderType == RENDER_RAYTRACE)) {
+		// the accumulated samples belong to the old scene
+		resetAccumulation();
+	}
+	globalLastFrameState = state;
+	return changed;
+}
+
+
+// render the scene at a range of resolutions and report the cost per frame and per pixel
+// (run it before CS488Window::start(), the resolution is restored afterwards)
+static void runResolutionBenchmark(const int frames = 3) {
+	const int resolutions[][2] = { { 128, 96 }, { 256, 192 }, { 512, 384 }, { 1280, 720 }, { 1920, 1080 }, { 3840, 2160 } };
+	const int oldWidth = FrameBuffer.width, oldHeight = FrameBuffer.height;
+	const bool oldShowRenderTime = globalShowRenderTime;
+	globalShowRenderTime = false;
+
+	globalViewDir = normalize(globalLookat - globalEye);
+	globalRight = normalize(cross(globalViewDir, globalUp));
+
+	printf("| Resolution | Pixels | Average frame time (ms) | Mpixels/s |\n");
+	printf("| --- | --- | --- | --- |\n");
+	for (const auto& res : resolutions) {
+		setResolution(res[0], res[1]);
+		double total = 0.0;
+		for (int f = 0; f < frames; f++) {
+			auto start = std::chrono::high_resolution_clock::now();
+			globalScene.Raytrace(0.0f);
+			total += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		}
+		const double ms = total / frames;
+		printf("| %dx%d | %d | %.1f | %.2f |\n", res[0], res[1], res[0] * res[1], ms, res[0] * res[1] / (ms * 1000.0));
+	}
+
+	globalShowRenderTime = oldShowRenderTime;
+	setResolution(oldWidth, oldHeight);
+}
+
+#ifdef CS488_SSE
+// single-thread throughput of the binary and the 4-wide BVH of every object, for closest-hit and occlusion
+// queries of incoherent rays (from a sphere around the object toward random points in its box)
+static void runTraversalBenchmark(const char* name, const int rayNum = 1 << 18) {
+	const bool oldWideBVH = globalWideBVH;
+	printf("| Mesh | Triangles | Binary closest hit (Mrays/s) | 4-wide closest hit (Mrays/s) | Binary occlusion (Mrays/s) | 4-wide occlusion (Mrays/s) |\n");
+	printf("| --- | --- | --- | --- | --- | --- |\n");
+	for (int i = 0; i < int(globalScene.objects.size()); i++) {
+		BVH& bvh = globalScene.bvhs[i];
+		if (!bvh.wideNodes) bvh.buildWide();
+		if (!bvh.wideNodes) continue;
+
+		const AABB& bbox = globalScene.objects[i]->bbox;
+		const float3 center = 0.5f * (bbox.get_minp() + bbox.get_maxp());
+		const float radius = length(bbox.get_size());
+		std::vector<Ray> rays(rayNum);
+		std::vector<float> tMax(rayNum);
+		for (int r = 0; r < rayNum; r++) {
+			const uint32_t key = PCG32::streamKey(r, i, globalFrameSeed);
+			const float z = 2.0f * PCG32::rand(key, 0) - 1.0f, phi = 2.0f * PI * PCG32::rand(key, 1);
+			const float s = sqrtf(std::max(0.0f, 1.0f - z * z));
+			const float3 o = center + radius * float3(s * cosf(phi), s * sinf(phi), z);
+			const float3 target = bbox.get_minp() + bbox.get_size() * float3(PCG32::rand(key, 2), PCG32::rand(key, 3), PCG32::rand(key, 4));
+			rays[r].o = o;
+			rays[r].d = normalize(target - o);
+			tMax[r] = length(target - o);
+		}
+
+		double mrays[4];
+		int hits[4];
+		for (int test = 0; test < 4; test++) {
+			globalWideBVH = (test % 2) == 1;
+			hits[test] = 0;
+			auto start = std::chrono::high_resolution_clock::now();
+			for (int r = 0; r < rayNum; r++) {
+				if (test < 2) {
+					HitInfo hit;
+					if (bvh.intersect(hit, rays[r], 0.0f, FLT_MAX)) hits[test]++;
+				} else {
+					if (bvh.occluded(rays[r], 0.0f, tMax[r])) hits[test]++;
+				}
+			}
+			mrays[test] = rayNum / (std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - start).count());
+		}
+		if ((hits[0] != hits[1]) || (hits[2] != hits[3])) printf("(the binary and the 4-wide BVH disagree: %d/%d hits, %d/%d occluded)\n", hits[0], hits[1], hits[2], hits[3]);
+		printf("| %s | %d | %.2f | %.2f | %.2f | %.2f |\n", name, int(globalScene.objects[i]->triangles.size()), mrays[0], mrays[1], mrays[2], mrays[3]);
+	}
+	globalWideBVH = oldWideBVH;
+}
+#endif
+
 static float3 reflect(const float3& viewDir, const float3& normal) {
 	return viewDir - 2 * dot(viewDir, normal) * normal;
 }
@@ -1979,40 +5382,48 @@ static bool refract(const float3& incident, const float3& normal, float ir, floa
 	return false;
 }
 
+// shadow ray from a Lambertian surface toward point light i, returns the distance to the light
+static float lightShadowRay(const HitInfo& hit, const int i, Ray& shadowRay) {
+	const float3 l = globalScene.pointLightSources[i]->position - hit.P;
+	shadowRay.o = hit.P + hit.N * Epsilon;	// avoid self-intersection
+	shadowRay.d = normalize(l);
+	return length(l);
+}
+
+// light reflected toward viewDir from point light i, if nothing is in the way
+static float3 lightContribution(const HitInfo& hit, const float3& viewDir, const int i) {
+	float3 l = globalScene.pointLightSources[i]->position - hit.P;
+
+	// the inverse-squared falloff
+	const float falloff = length2(l);
+
+	// normalize the light direction
+	l /= sqrtf(falloff);
+
+	// get the irradiance
+	const float3 irradiance = float(std::max(0.0f, dot(hit.N, l)) / (4.0 * PI * falloff)) * globalScene.pointLightSources[i]->wattage;
+	float3 brdf = hit.material->BRDF(l, viewDir, hit.N);
+
+	if (hit.material->isTextured) {
+		brdf *= hit.material->fetchTexture(hit.T);
+	}
+	//return brdf * PI; //debug output
+
+	return irradiance * brdf;
+}
+
 static float3 shadeLambertian(const HitInfo& hit, const float3& viewDir, const int level) {
 	// you may want to add shadow ray tracing here in A1
 	float3 L = float3(0.0f);
-	float3 brdf, irradiance;
 
 	// loop over all of the point light sources
 	for (int i = 0; i < globalScene.pointLightSources.size(); i++) {
-		float3 l = globalScene.pointLightSources[i]->position - hit.P;
-		float l_dist = length(l);
-
 		// Shadow Ray 
 		Ray shadowRay;
-		shadowRay.o = hit.P + hit.N * Epsilon;	// avoid self-intersection
-		shadowRay.d = normalize(l);
-
-		HitInfo shadowHit;
-			
-		if (!globalScene.intersect(shadowHit, shadowRay, miniEps, l_dist)) { // - Epsilon
-			// the inverse-squared falloff
-			const float falloff = length2(l);
+		const float l_dist = lightShadowRay(hit, i, shadowRay);
 
-			// normalize the light direction
-			l /= sqrtf(falloff);
-
-			// get the irradiance
-			irradiance = float(std::max(0.0f, dot(hit.N, l)) / (4.0 * PI * falloff)) * globalScene.pointLightSources[i]->wattage;
-			brdf = hit.material->BRDF(l, viewDir, hit.N);
-
-			if (hit.material->isTextured) {
-				brdf *= hit.material->fetchTexture(hit.T);
-			}
-			//return brdf * PI; //debug output
-
-			L += irradiance * brdf;
+		if (!globalScene.occluded(shadowRay, miniEps, l_dist)) { // - Epsilon
+			L += lightContribution(hit, viewDir, i);
 		}
 		//else {
 		//	return float3(1.0f, 0.0f, 0.0f);
@@ -2050,11 +5461,9 @@ static float3 shadeDebug(const HitInfo& hit, const float3& viewDir, const int le
 	return L;
 }
 
-static float3 shadeMetal(const HitInfo& hit, const float3& viewDir, const int level) {
-	const int MAX_LEVEL = 4;
-	if (level >= MAX_LEVEL) {
-		return globalScene.getEnvironment(viewDir);
-	}
+// specular bounce off a metal surface
+// "ray" is the reflected ray and "weight" scales whatever it sees
+static void scatterMetal(const HitInfo& hit, const float3& viewDir, Ray& ray, float3& weight, float& tMin) {
 	float3 reflectedDir = reflect(viewDir, hit.N);
 
 	// check shading (interpolated) normal
@@ -2062,25 +5471,14 @@ static float3 shadeMetal(const HitInfo& hit, const float3& viewDir, const int le
 	//	reflectedDir = reflectedDir - 2.0f * dot(reflectedDir, hit.N_g) * hit.N_g;
 	//}
 
-	Ray reflectedRay;
-	reflectedRay.o = hit.P + hit.N * Epsilon; // avoid self-intersection
-	reflectedRay.d = normalize(-reflectedDir);
-
-	HitInfo reflectedHitInfo;
-	if (globalScene.intersect(reflectedHitInfo, reflectedRay, miniEps)) {
-		return hit.material->Ks * shade(reflectedHitInfo, -reflectedRay.d, level + 1);
-	}
-	else {
-		return globalScene.getEnvironment(reflectedRay.d);
-	}
+	ray.o = hit.P + hit.N * Epsilon; // avoid self-intersection
+	ray.d = normalize(-reflectedDir);
+	weight = hit.material->Ks;
+	tMin = miniEps;
 }
 
-static float3 shadeGlass(const HitInfo& hit, const float3& viewDir, const int level) {
-	const int MAX_LEVEL = 5;
-	if (level >= MAX_LEVEL) {
-		return globalScene.getEnvironment(viewDir);
-	}
-
+// specular refraction (or total internal reflection) through a glass surface
+static void scatterGlass(const HitInfo& hit, const float3& viewDir, Ray& ray, float3& weight, float& tMin) {
 	float3 refractedDir;
 	float eta = hit.material->eta;
 	float3 N = hit.N;
@@ -2096,79 +5494,120 @@ static float3 shadeGlass(const HitInfo& hit, const float3& viewDir, const int le
 	//cos_theta = dot(viewDir, N);
 
 	float k = 1.0f - eta * eta * (1.0f - cos_theta * cos_theta);
+	tMin = Epsilon;
 
 	if (k < 0.0f) {
 		// Total internal reflection
 		refractedDir = reflect(viewDir, hit.N);
-		
+
 		// Ensure reflection direction is on correct side of geometric normal
 		if (dot(hit.N_g, refractedDir) < 0.0f) {
 			refractedDir = refractedDir - dot(2.0f * refractedDir, hit.N_g) * hit.N_g;
 		}
 
-		Ray reflectedRay;
-		reflectedRay.o = hit.P + N * Epsilon;
-		reflectedRay.d = normalize(-refractedDir);
-		
-		HitInfo reflectedHitInfo;
-		if (globalScene.intersect(reflectedHitInfo, reflectedRay, Epsilon)) {
-			return hit.material->Ks * shade(reflectedHitInfo, -reflectedRay.d, level + 1); // hit.material->Ks
-		}
-		else {
-			return globalScene.getEnvironment(reflectedRay.d);
-		}
-
+		ray.o = hit.P + N * Epsilon;
+		ray.d = normalize(-refractedDir);
+		weight = hit.material->Ks;
 	} else {
 		refractedDir = eta * (viewDir - cos_theta * N) - sqrt(k) * N;
-		
-		Ray refractedRay;
-		refractedRay.o = hit.P + N * Epsilon;
-		refractedRay.d = normalize(-refractedDir);
 
-		HitInfo refractedHitInfo;
-		if (globalScene.intersect(refractedHitInfo, refractedRay, Epsilon)) {
-			return shade(refractedHitInfo, -refractedRay.d, level + 1);
-		}
-		else {
-			return globalScene.getEnvironment(refractedRay.d);
-		}
+		ray.o = hit.P + N * Epsilon;
+		ray.d = normalize(-refractedDir);
+		weight = float3(1.0f);
 	}
 }
 
 // ====== implement it in A1 ======
 // fill in the missing parts
-static float3 shade(const HitInfo& hit, const float3& viewDir, const int level) {
-	if (hit.material->type == MAT_LAMBERTIAN) {
+// direct lighting of a Lambertian surface
+static float3 shadeSurface(const HitInfo& hit, const float3& viewDir, const int level) {
 #ifndef LAMBERTIAN_SHADOW
-		// For no shadows
-		return shadeDebug(hit, viewDir, level);
+	// For no shadows
+	return shadeDebug(hit, viewDir, level);
 #else
-		// For shadows
-		return shadeLambertian(hit, viewDir, level);
-
+	// For shadows
+	return shadeLambertian(hit, viewDir, level);
 #endif // !LAMBERTIAN_SHADOW
+}
 
-	} else if (hit.material->type == MAT_METAL) {
-		return shadeMetal(hit, viewDir, level);
-		//return float3(0.0f); // replace this
-	} else if (hit.material->type == MAT_GLASS) {
-		return shadeGlass(hit, viewDir, level);
-		//return float3(0.0f); // replace this
-	} else {
-		// something went wrong - make it apparent that it is an error
-		return float3(100.0f, 0.0f, 100.0f);
+// iterative integrator: follows the specular bounces with a throughput weight instead of recursing,
+// and ends the path at the first Lambertian surface (direct lighting), at the environment or at a depth limit
+// "record" optionally receives where the path ended up (for relighting and reprojection)
+static float3 shade(const HitInfo& firstHit, const float3& firstViewDir, const int firstLevel, ShadingRecord* record) {
+	float3 L = float3(0.0f);
+	float3 throughput = float3(1.0f);
+	HitInfo hit = firstHit;
+	float3 viewDir = firstViewDir;
+
+	for (int level = firstLevel; ; level++) {
+		Ray ray;
+		float3 weight;
+		float tMin;
+
+		if (hit.material->type == MAT_LAMBERTIAN) {
+			if (record) {
+				record->hit = hit;
+				record->viewDir = viewDir;
+				record->throughput = throughput;
+				record->level = level - firstLevel;
+				return throughput * shadeSurface(hit, viewDir, level);
+			}
+			L += throughput * shadeSurface(hit, viewDir, level);
+			break;
+		} else if (hit.material->type == MAT_METAL) {
+			if (level >= globalMaxMetalLevel) {
+				L += throughput * globalScene.getEnvironment(viewDir);
+				break;
+			}
+			scatterMetal(hit, viewDir, ray, weight, tMin);
+		} else if (hit.material->type == MAT_GLASS) {
+			if (level >= globalMaxGlassLevel) {
+				L += throughput * globalScene.getEnvironment(viewDir);
+				break;
+			}
+			scatterGlass(hit, viewDir, ray, weight, tMin);
+		} else {
+			// something went wrong - make it apparent that it is an error
+			L += throughput * float3(100.0f, 0.0f, 100.0f);
+			break;
+		}
+
+		// the environment seen by a specular bounce is not scaled by the bounce weight
+		if (!globalScene.intersect(hit, ray, tMin)) {
+			L += throughput * globalScene.getEnvironment(ray.d);
+			break;
+		}
+		throughput *= weight;
+		viewDir = -ray.d;
+
+		// paths that carry (almost) nothing are dropped
+		if (maxelem(throughput) < globalThroughputThreshold) break;
+	}
+	if (record) {
+		record->hit.material = nullptr;
+		record->radiance = L;
 	}
+	return L;
 }
 
 
 
 
 
+#ifndef CS488_HEADLESS
 // OpenGL initialization (you will not use any OpenGL/Vulkan/DirectX... APIs to render 3D objects!)
 // you probably do not need to modify this in A0 to A3.
 class OpenGLInit {
 public:
-	OpenGLInit() {
+	bool initialized = false;
+
+	OpenGLInit() {}
+
+	// opens a window of width x height pixels
+	void initialize(const int width, const int height) {
+		if (initialized) return;
+		initialized = true;
+
 		// initialize GLFW
 		if (!glfwInit()) {
 			std::cerr << "Failed to initialize GLFW." << std::endl;
@@ -2177,7 +5616,7 @@ public:
 
 		// create a window
 		glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
-		globalGLFWindow = glfwCreateWindow(globalWidth, globalHeight, "Welcome to CS488/688! Ivy A2", NULL, NULL);
+		globalGLFWindow = glfwCreateWindow(width, height, "Welcome to CS488/688! Ivy A2", NULL, NULL);
 		if (globalGLFWindow == NULL) {
 			std::cerr << "Failed to open GLFW window." << std::endl;
 			glfwTerminate();
@@ -2199,6 +5638,7 @@ public:
 		glfwSetKeyCallback(globalGLFWindow, keyFunc);
 		glfwSetMouseButtonCallback(globalGLFWindow, mouseButtonFunc);
 		glfwSetCursorPosCallback(globalGLFWindow, cursorPosFunc);
+		glfwSetWindowRefreshCallback(globalGLFWindow, refreshFunc);
 
 		// create shader
 		FSDraw = glCreateProgram();
@@ -2216,7 +5656,7 @@ public:
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F_ARB, globalWidth, globalHeight, 0, GL_LUMINANCE, GL_FLOAT, 0);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F_ARB, width, height, 0, GL_LUMINANCE, GL_FLOAT, 0);
 
 		// initialize some OpenGL state (will not change)
 		glDisable(GL_DEPTH_TEST);
@@ -2240,7 +5680,7 @@ public:
 	}
 
 	virtual ~OpenGLInit() {
-		glfwTerminate();
+		if (initialized) glfwTerminate();
 	}
 };
 
@@ -2251,6 +5691,7 @@ public:
 class CS488Window {
 public:
 	// put this first to make sure that the glInit's constructor is called before the one for CS488Window
+	// (the window itself is opened in start(), so that the resolution can still be changed before that)
 	OpenGLInit glInit;
 
 	CS488Window() {}
@@ -2258,31 +5699,52 @@ public:
 
 	void(*process)() = NULL;
 
-	void start() const {
+	// the window has the resolution of FrameBuffer
+	void start() {
+		glInit.initialize(FrameBuffer.width, FrameBuffer.height);
+
 		if (globalEnableParticles) {
 			globalScene.addObject(&globalParticleSystem.particlesMesh);
 		}
 		globalScene.preCalc();
 
 		// main loop
+		// a frame is only rendered if something has changed or the last one is not final yet (progressive
+		// refinement, preview, frame budget), otherwise the loop sleeps until the next event
+		bool idle = false;
 		while (glfwWindowShouldClose(globalGLFWindow) == GL_FALSE) {
-			glfwPollEvents();
+			if (idle) {
+				glfwWaitEvents();
+			} else {
+				glfwPollEvents();
+			}
 			globalViewDir = normalize(globalLookat - globalEye);
 			globalRight = normalize(cross(globalViewDir, globalUp));
+			updateCameraMotion();
 
 			if (globalEnableParticles) {
 				globalParticleSystem.step();
 			}
 
-			if (globalRenderType == RENDER_RASTERIZE) {
-				globalScene.Rasterize();
-			} else if (globalRenderType == RENDER_RAYTRACE) {
-				globalScene.Raytrace();
-			} else if (globalRenderType == RENDER_IMAGE) {
-				if (process) process();
+			const bool changed = updateFrameState();
+			const bool render = changed || globalRedraw || !globalFrameComplete || (globalRenderType == RENDER_IMAGE);
+			globalRedraw = false;
+			if (render) {
+				if (globalRenderType == RENDER_RASTERIZE) {
+					globalScene.Rasterize();
+					globalFrameComplete = true;
+				} else if (globalRenderType == RENDER_RAYTRACE) {
+					// the frame budget is for interaction - once the scene stands still, the frame is finished
+					globalScene.Raytrace(changed ? globalFrameBudget : 0.0f);
+				} else if (globalRenderType == RENDER_IMAGE) {
+					if (process) process();
+				}
 			}
+			idle = globalFrameComplete && !globalEnableParticles && (globalRenderType != RENDER_IMAGE);
+			if (!render && !globalRedisplay) continue;
+			globalRedisplay = false;
 
-			if (globalRecording) {
+			if (render && globalRecording) {
 				unsigned char* buf = new unsigned char[FrameBuffer.width * FrameBuffer.height * 4];
 				int k = 0;
 				for (int j = FrameBuffer.height - 1; j >= 0; j--) {
@@ -2293,18 +5755,18 @@ public:
 						buf[k++] = 255;
 					}
 				}
-				GifWriteFrame(&globalGIFfile, buf, globalWidth, globalHeight, globalGIFdelay);
+				GifWriteFrame(&globalGIFfile, buf, FrameBuffer.width, FrameBuffer.height, globalGIFdelay);
 				delete[] buf;
 			}
 
 			// drawing the frame buffer via OpenGL (you don't need to touch this)
-			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, globalWidth, globalHeight, GL_RGB, GL_FLOAT, &FrameBuffer.pixels[0][0]);
+			glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, FrameBuffer.width, FrameBuffer.height, GL_RGB, GL_FLOAT, &FrameBuffer.pixels[0][0]);
 			glRecti(1, 1, -1, -1);
 			glfwSwapBuffers(globalGLFWindow);
 			globalFrameCount++;
-			PCG32::rand();
 		}
 	}
 };
+#endif // !CS488_HEADLESS
 
 
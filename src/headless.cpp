@@ -0,0 +1,715 @@
+// offline renderer without a window (no GLFW/GLEW/OpenGL), for render nodes without a display or a GPU
+// the scene is loaded and its BVH is built once, then every frame of a batch is rendered from it
+#define CS488_HEADLESS
+#include "cs488.h"
+#include <map>
+
+// process and directory handling for the multi-process renderer
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#include <windows.h>
+#else
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
+
+
+// command line
+//   CS488Headless scene.obj [environment map] [options]
+//   -o file.png        output image (default output.png)
+//   -res WxH           render resolution (default 512x384)
+//   -eye x,y,z         camera position
+//   -lookat x,y,z      camera target
+//   -up x,y,z          camera up vector
+//   -light x,y,z       position of the point light source
+//   -wattage w         power of the point light source
+//   -mode raytrace|rasterize
+//   -spp N             ray tracing: N jittered samples per pixel (default 1, one sample through the pixel center)
+//   -adaptive E        ray tracing: stop sampling a pixel once its relative error is below E (with -spp, not with -workers)
+//   -seed N            ray tracing: offsets the random jitters of -spp, which also change with every -batch frame
+//                      (the image does not depend on -threads or -workers)
+//   -threads N         number of render threads (default: all cores)
+//   -bvh median|sah|binned|lbvh|sbvh
+//                      how the BVH is built (default binned with SAHBVH, median otherwise; not per batch frame)
+//   -morton 30|63      bits of the Morton codes of -bvh lbvh (default 30)
+//   -duplicates F      -bvh sbvh may add up to F times the number of triangles as references (default 0.3, at most 4)
+//   -treelets          restructure the tree of -bvh lbvh with treelets
+//   -wide              also build 4-wide BVHs and trace the rays with them
+//   -instances file    also place meshes by "file", one instance per line: "mesh.obj x,y,z [scale] [angle]" (the angle
+//                      in degrees around the y axis); every mesh is loaded and gets its BVH once
+//   -bvhcache dir      reuse the BVHs of the .obj files from "dir" (memory-mapped), and save the ones built there
+//   -raybench          print the rays/s of the binary and the 4-wide BVH of the scene instead of rendering
+//   -quiet             do not print timings
+//   -batch file        render one frame per line of "file", each line being options as above (applied on top
+//                      of the ones on the command line), e.g. "-eye 0,0,1.5 -o frame0001.png"
+//   -workers N         ray trace the frame with N processes sharing a job spool (see below)
+//   -spool dir         spool directory for -workers (default: the output file name + ".spool")
+//   -jobtile N         size of the tiles handed out to the worker processes (default 32)
+//   -keepspool         do not delete the spool after merging
+//   -stalltimeout S    render the tiles of workers started by hand here once none of them has finished for S
+//                      seconds (default 10; the workers launched by -workers are waited for as long as they run)
+//   -worker dir        join the render of the spool "dir" as a worker (the scene and options are read from it)
+static const char* usage = "Usage: CS488Headless scene.obj [environment map] [-o file.png] [-res WxH] [-eye x,y,z] [-lookat x,y,z] [-up x,y,z]\n"
+    "    [-light x,y,z] [-wattage w] [-mode raytrace|rasterize] [-spp N] [-adaptive E] [-seed N] [-threads N]\n"
+    "    [-bvh median|sah|binned|lbvh|sbvh] [-morton 30|63] [-duplicates F] [-treelets] [-wide] [-instances file] [-bvhcache dir] [-raybench] [-quiet] [-batch file] [-workers N] [-spool dir] [-jobtile N] [-keepspool] [-stalltimeout S]\n"
+    "       CS488Headless -worker dir [-threads N]\n";
+
+// everything that can change from frame to frame
+struct FrameOptions {
+    std::string output = "output.png";
+    int width = globalDefaultWidth, height = globalDefaultHeight;
+    float3 eye = globalEye, lookat = globalLookat, up = globalUp;
+    float3 lightPosition = float3(3.0f, 3.0f, 3.0f);
+    float lightWattage = 1000.0f;
+    enumRenderType renderType = RENDER_RAYTRACE;
+    int samples = 1;
+    float adaptiveThreshold = 0.0f;
+};
+
+// the scene options that are not per frame
+static std::string instancesFile;
+
+static bool parseFloat3(const char* text, float3& v) {
+    return sscanf(text, "%f,%f,%f", &v.x, &v.y, &v.z) == 3;
+}
+
+// applies the options in args[0..n) to "frame", the remaining arguments go to "positional"
+static bool parseFrameOptions(const std::vector<std::string>& args, FrameOptions& frame, std::vector<std::string>* positional, std::string* batchFile) {
+    const int n = (int)args.size();
+    for (int i = 0; i < n; i++) {
+        const std::string& arg = args[i];
+        const bool hasValue = (i + 1 < n);
+        if (arg == "-o" && hasValue) {
+            frame.output = args[++i];
+        } else if (arg == "-res" && hasValue) {
+            if (sscanf(args[++i].c_str(), "%dx%d", &frame.width, &frame.height) != 2) {
+                printf("Invalid resolution \"%s\", expected WxH.\n", args[i].c_str());
+                return false;
+            }
+        } else if ((arg == "-eye" || arg == "-lookat" || arg == "-up" || arg == "-light") && hasValue) {
+            float3& v = (arg == "-eye") ? frame.eye : (arg == "-lookat") ? frame.lookat : (arg == "-up") ? frame.up : frame.lightPosition;
+            if (!parseFloat3(args[++i].c_str(), v)) {
+                printf("Invalid vector \"%s\" for %s, expected x,y,z.\n", args[i].c_str(), arg.c_str());
+                return false;
+            }
+        } else if (arg == "-wattage" && hasValue) {
+            frame.lightWattage = float(atof(args[++i].c_str()));
+        } else if (arg == "-mode" && hasValue) {
+            const std::string mode = args[++i];
+            if (mode == "raytrace") {
+                frame.renderType = RENDER_RAYTRACE;
+            } else if (mode == "rasterize") {
+                frame.renderType = RENDER_RASTERIZE;
+            } else {
+                printf("Invalid render mode \"%s\", expected raytrace or rasterize.\n", mode.c_str());
+                return false;
+            }
+        } else if (arg == "-spp" && hasValue) {
+            frame.samples = std::max(1, atoi(args[++i].c_str()));
+        } else if (arg == "-adaptive" && hasValue) {
+            frame.adaptiveThreshold = float(atof(args[++i].c_str()));
+        } else if (arg == "-seed" && hasValue) {
+            globalFrameSeed = unsigned(strtoul(args[++i].c_str(), nullptr, 10));
+        } else if (arg == "-threads" && hasValue) {
+            globalNumThreads = std::max(1, atoi(args[++i].c_str()));
+        } else if (arg == "-bvh" && hasValue) {
+            const std::string builder = args[++i];
+            if (builder == "median") {
+                globalBVHBuilder = BVH_MEDIAN;
+            } else if (builder == "sah") {
+                globalBVHBuilder = BVH_SAH;
+            } else if (builder == "binned") {
+                globalBVHBuilder = BVH_BINNED_SAH;
+            } else if (builder == "lbvh") {
+                globalBVHBuilder = BVH_LBVH;
+            } else if (builder == "sbvh") {
+                globalBVHBuilder = BVH_SBVH;
+            } else {
+                printf("Invalid BVH builder \"%s\", expected median, sah, binned, lbvh or sbvh.\n", builder.c_str());
+                return false;
+            }
+        } else if (arg == "-morton" && hasValue) {
+            globalLBVHMortonBits = (atoi(args[++i].c_str()) > 30) ? 63 : 30;
+        } else if (arg == "-duplicates" && hasValue) {
+            globalSBVHDuplication = fminf(fmaxf(float(atof(args[++i].c_str())), 0.0f), BVH::SBVHDuplicationMax);
+        } else if (arg == "-treelets") {
+            globalLBVHTreelets = true;
+        } else if (arg == "-instances" && hasValue) {
+            instancesFile = args[++i];
+        } else if (arg == "-bvhcache" && hasValue) {
+            globalBVHCacheDir = args[++i];
+        } else if (arg == "-wide") {
+            globalWideBVH = true;
+        } else if (arg == "-quiet") {
+            globalShowRenderTime = false;
+        } else if (arg == "-batch" && hasValue && batchFile) {
+            *batchFile = args[++i];
+        } else if ((arg[0] != '-') && positional) {
+            positional->push_back(arg);
+        } else {
+            printf("Unknown option \"%s\".\n", arg.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+static void applyFrameOptions(const FrameOptions& frame, PointLightSource& light) {
+    if ((frame.width != FrameBuffer.width) || (frame.height != FrameBuffer.height)) {
+        setResolution(frame.width, frame.height);
+    }
+    globalEye = frame.eye;
+    globalLookat = frame.lookat;
+    globalUp = normalize(frame.up);
+    globalViewDir = normalize(globalLookat - globalEye);
+    globalRight = normalize(cross(globalViewDir, globalUp));
+    light.position = frame.lightPosition;
+    light.wattage = float3(frame.lightWattage);
+}
+
+static void renderFrame(const FrameOptions& frame, PointLightSource& light) {
+    applyFrameOptions(frame, light);
+
+    if (frame.renderType == RENDER_RASTERIZE) {
+        globalScene.Rasterize();
+    } else if (frame.samples > 1) {
+        // all the samples in one progressive pass
+        globalProgressive = true;
+        globalSamplesPerFrame = frame.samples;
+        globalTargetSamples = frame.samples;
+        globalAdaptiveSampling = (frame.adaptiveThreshold > 0.0f);
+        if (globalAdaptiveSampling) globalAdaptiveThreshold = frame.adaptiveThreshold;
+        resetAccumulation();
+        globalScene.Raytrace(0.0f);
+    } else {
+        globalProgressive = false;
+        globalScene.Raytrace(0.0f);
+    }
+    FrameBuffer.save(frame.output.c_str());
+}
+
+// multi-process rendering
+// the coordinator (-workers N) splits the frame into job tiles and writes one file per tile into <spool>/todo.
+// each worker process claims the next tile by renaming its file into <spool>/claimed, which only one process can
+// win. the workers are the coordinator itself, the N - 1 processes it launches, and any started by hand with
+// -worker <spool>, e.g., in another NUMA domain or container. a worker renders the tile and publishes the sum of
+// its samples and their weights in <spool>/done. tiles are handed out one at a time, so expensive regions
+// (e.g., glass) do not leave the other processes idle.
+class Spool {
+public:
+    std::string dir;
+    int numTiles = 0;
+
+    std::string path(const char* name) const { return dir + "/" + name; }
+    std::string tilePath(const char* subdir, const int i, const char* extension) const {
+        char name[64];
+        sprintf(name, "/%s/tile%06d%s", subdir, i, extension);
+        return dir + name;
+    }
+    std::string todo(const int i) const { return tilePath("todo", i, ".job"); }
+    std::string claimed(const int i) const { return tilePath("claimed", i, ".job"); }
+    std::string done(const int i) const { return tilePath("done", i, ".bin"); }
+};
+
+static bool makeDirectory(const std::string& dir) {
+#ifdef _WIN32
+    return (_mkdir(dir.c_str()) == 0) || (errno == EEXIST);
+#else
+    return (mkdir(dir.c_str(), 0755) == 0) || (errno == EEXIST);
+#endif
+}
+
+static void removeDirectory(const std::string& dir) {
+#ifdef _WIN32
+    _rmdir(dir.c_str());
+#else
+    rmdir(dir.c_str());
+#endif
+}
+
+static bool readLines(const std::string& fileName, std::vector<std::string>& lines) {
+    FILE* fp = fopen(fileName.c_str(), "r");
+    if (!fp) return false;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp)) {
+        std::string text = line;
+        while (!text.empty() && ((text.back() == '\n') || (text.back() == '\r'))) text.pop_back();
+        lines.push_back(text);
+    }
+    fclose(fp);
+    return true;
+}
+
+static bool writeLines(const std::string& fileName, const std::vector<std::string>& lines) {
+    FILE* fp = fopen(fileName.c_str(), "w");
+    if (!fp) return false;
+    for (const std::string& line : lines) fprintf(fp, "%s\n", line.c_str());
+    fclose(fp);
+    return true;
+}
+
+// the coordinator takes over the unfinished tiles of workers started by hand once none of them has been finished
+// for this long (in seconds)
+static int globalWorkerStallTimeout = 10;
+
+static long currentProcessId() {
+#ifdef _WIN32
+    return long(_getpid());
+#else
+    return long(getpid());
+#endif
+}
+
+// the scene and its options are kept in the spool, so that a worker only needs to know the directory
+static bool openSpool(const std::string& dir, Spool& spool, std::vector<std::string>& args) {
+    spool.dir = dir;
+    std::vector<std::string> tiles;
+    if (!readLines(spool.path("tiles.txt"), tiles) || tiles.empty() || !readLines(spool.path("settings.txt"), args)) {
+        printf("\"%s\" is not a render spool.\n", dir.c_str());
+        return false;
+    }
+    spool.numTiles = atoi(tiles[0].c_str());
+    return true;
+}
+
+static void writeJob(const Spool& spool, const int i, const RenderTile& region) {
+    char job[128];
+    sprintf(job, "%d %d %d %d", region.x0, region.y0, region.x1, region.y1);
+    writeLines(spool.todo(i), { job });
+}
+
+// claim and render tiles until there are none left, returns the number of tiles rendered
+static int renderSpoolTiles(const Spool& spool, const int samples) {
+    int rendered = 0;
+    for (int i = 0; i < spool.numTiles; i++) {
+        // another worker got there first
+        if (rename(spool.todo(i).c_str(), spool.claimed(i).c_str()) != 0) continue;
+
+        std::vector<std::string> job;
+        RenderTile region;
+        if (!readLines(spool.claimed(i), job) || job.empty() || (sscanf(job[0].c_str(), "%d %d %d %d", &region.x0, &region.y0, &region.x1, &region.y1) != 4)) {
+            printf("Invalid job \"%s\".\n", spool.claimed(i).c_str());
+            continue;
+        }
+        // the owner, so that the coordinator knows whether a claimed tile is still being rendered
+        writeLines(spool.claimed(i), { job[0], std::to_string(currentProcessId()) });
+
+        std::vector<float3> sum;
+        std::vector<float> weights;
+        globalScene.RaytraceRegion(region, samples, sum, weights);
+
+        // written under a temporary name first, so that a half-written result is never merged
+        // (a tile that could not be written stays claimed, and the coordinator renders it again)
+        const std::string temporary = spool.tilePath("done", i, ".tmp");
+        FILE* fp = fopen(temporary.c_str(), "wb");
+        if (!fp) {
+            printf("Could not write \"%s\".\n", temporary.c_str());
+            continue;
+        }
+        const int header[4] = { region.x0, region.y0, region.x1, region.y1 };
+        bool written = (fwrite(header, sizeof(int), 4, fp) == 4);
+        for (int p = 0, p_n = (int)sum.size(); written && (p < p_n); p++) {
+            const float value[4] = { sum[p].x, sum[p].y, sum[p].z, weights[p] };
+            written = (fwrite(value, sizeof(float), 4, fp) == 4);
+        }
+        written = (fclose(fp) == 0) && written;
+        remove(spool.done(i).c_str());
+        if (!written || (rename(temporary.c_str(), spool.done(i).c_str()) != 0)) {
+            printf("Could not write \"%s\".\n", temporary.c_str());
+            remove(temporary.c_str());
+            continue;
+        }
+        rendered++;
+    }
+    return rendered;
+}
+
+// reads a tile result, which has to cover exactly the region of its job
+static bool readTileResult(const std::string& fileName, const RenderTile& region, std::vector<float>& values) {
+    FILE* fp = fopen(fileName.c_str(), "rb");
+    if (!fp) return false;
+    int header[4];
+    bool valid = (fread(header, sizeof(int), 4, fp) == 4) && (header[0] == region.x0) && (header[1] == region.y0) && (header[2] == region.x1) && (header[3] == region.y1);
+    if (valid) {
+        values.resize(size_t(region.x1 - region.x0) * (region.y1 - region.y0) * 4);
+        valid = (fread(values.data(), sizeof(float), values.size(), fp) == values.size()) && (fgetc(fp) == EOF);
+    }
+    fclose(fp);
+    return valid;
+}
+
+// add a tile result to the accumulated sums and weights of the whole frame (nothing is added unless it is complete)
+static bool mergeTileResult(const std::string& fileName, const RenderTile& region, Image& sum, std::vector<float>& weights) {
+    std::vector<float> values;
+    if (!readTileResult(fileName, region, values)) return false;
+    const float* value = values.data();
+    for (int y = region.y0; y < region.y1; y++) {
+        for (int x = region.x0; x < region.x1; x++, value += 4) {
+            sum.pixel(x, y) += float3(value[0], value[1], value[2]);
+            weights[x + y * sum.width] += value[3];
+        }
+    }
+    return true;
+}
+
+#ifdef _WIN32
+typedef intptr_t ProcessId;
+#else
+typedef pid_t ProcessId;
+#endif
+
+static bool launchWorker(const char* executable, const std::string& spoolDir, ProcessId& process) {
+#ifdef _WIN32
+    process = _spawnl(_P_NOWAIT, executable, executable, "-worker", spoolDir.c_str(), NULL);
+    return process != -1;
+#else
+    const char* workerArgs[] = { executable, "-worker", spoolDir.c_str(), NULL };
+    return posix_spawnp(&process, executable, NULL, NULL, const_cast<char* const*>(workerArgs), environ) == 0;
+#endif
+}
+
+// does not block: false once the worker has exited (and has been reaped)
+static bool workerRunning(const ProcessId process) {
+#ifdef _WIN32
+    if (WaitForSingleObject((HANDLE)process, 0) == WAIT_TIMEOUT) return true;
+    CloseHandle((HANDLE)process);
+    return false;
+#else
+    int status;
+    return waitpid(process, &status, WNOHANG) == 0;
+#endif
+}
+
+// the id that the worker writes into the tiles it claims
+static long workerProcessId(const ProcessId process) {
+#ifdef _WIN32
+    return long(GetProcessId((HANDLE)process));
+#else
+    return long(process);
+#endif
+}
+
+// adds the instances of -instances to the scene
+static bool loadInstances(const std::string& fileName) {
+    FILE* fp = fopen(fileName.c_str(), "r");
+    if (!fp) {
+        printf("Could not open \"%s\".\n", fileName.c_str());
+        return false;
+    }
+    static std::deque<TriangleMesh> meshes;
+    std::map<std::string, int> objectIndices;
+    char line[4096], meshFile[4096], position[256];
+    int lineNumber = 0, instanceNum = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        float scale = 1.0f, angle = 0.0f;
+        float3 p;
+        if ((line[0] == '#') || (sscanf(line, "%4095s %255s %f %f", meshFile, position, &scale, &angle) < 2)) continue;
+        if (!parseFloat3(position, p)) {
+            printf("Skipping line %d of \"%s\".\n", lineNumber, fileName.c_str());
+            continue;
+        }
+        auto found = objectIndices.find(meshFile);
+        if (found == objectIndices.end()) {
+            meshes.emplace_back();
+            if (!meshes.back().load(meshFile)) {
+                printf("Could not load \"%s\".\n", meshFile);
+                fclose(fp);
+                return false;
+            }
+            found = objectIndices.insert(std::make_pair(std::string(meshFile), globalScene.addMesh(&meshes.back()))).first;
+        }
+        const float4x4 m = mul(linalg::translation_matrix(p), mul(linalg::rotation_matrix(linalg::rotation_quat(float3(0.0f, 1.0f, 0.0f), angle * DegToRad)), linalg::scaling_matrix(float3(scale))));
+        globalScene.addInstance(found->second, m);
+        instanceNum++;
+    }
+    fclose(fp);
+    printf("%d instances of %d meshes.\n", instanceNum, int(objectIndices.size()));
+    return true;
+}
+
+static bool loadScene(const std::vector<std::string>& positional, TriangleMesh& mesh, PointLightSource& light) {
+    if (!globalBVHCacheDir.empty() && !makeDirectory(globalBVHCacheDir)) {
+        printf("Could not create the BVH cache \"%s\".\n", globalBVHCacheDir.c_str());
+        globalBVHCacheDir.clear();
+    }
+    if (!mesh.load(positional[0].c_str())) {
+        printf("Could not load \"%s\".\n", positional[0].c_str());
+        return false;
+    }
+    if (positional.size() > 1) {
+        EnvironMap.loaded = (EnvironMap.load(positional[1].c_str()) != 0);
+        if (!EnvironMap.loaded) {
+            printf("Could not load the environment map \"%s\".\n", positional[1].c_str());
+            return false;
+        }
+    }
+    globalScene.addObject(&mesh);
+    if (!instancesFile.empty() && !loadInstances(instancesFile)) return false;
+    globalScene.addLight(&light);
+    globalScene.preCalc();
+    return true;
+}
+
+// coordinator: write the jobs, launch the workers, render along with them and merge the results
+static int renderDistributed(const FrameOptions& frame, const std::vector<std::string>& renderArgs, const std::string& spoolDir,
+    const int numWorkers, const int jobTileSize, const bool keepSpool, const char* executable) {
+    auto start = std::chrono::high_resolution_clock::now();
+
+    Spool spool;
+    spool.dir = spoolDir;
+    if (!makeDirectory(spool.dir) || !makeDirectory(spool.path("todo")) || !makeDirectory(spool.path("claimed")) || !makeDirectory(spool.path("done"))) {
+        printf("Could not create the spool \"%s\".\n", spool.dir.c_str());
+        return 1;
+    }
+
+    // the processes (this one included) share the cores unless told otherwise
+    std::vector<std::string> settings = renderArgs;
+    const int allThreads = globalNumThreads;
+    if (std::find(settings.begin(), settings.end(), "-threads") == settings.end()) {
+        globalNumThreads = std::max(1, int(std::thread::hardware_concurrency()) / numWorkers);
+        settings.push_back("-threads");
+        settings.push_back(std::to_string(globalNumThreads));
+    }
+
+    std::vector<RenderTile> jobs;
+    for (int y = 0; y < frame.height; y += jobTileSize) {
+        for (int x = 0; x < frame.width; x += jobTileSize) {
+            jobs.push_back({ x, y, std::min(x + jobTileSize, frame.width), std::min(y + jobTileSize, frame.height) });
+        }
+    }
+    spool.numTiles = (int)jobs.size();
+    for (int i = 0; i < spool.numTiles; i++) {
+        remove(spool.claimed(i).c_str());
+        remove(spool.done(i).c_str());
+        writeJob(spool, i, jobs[i]);
+    }
+    // the tile count goes last: a worker started by hand does not start before the jobs are there
+    writeLines(spool.path("settings.txt"), settings);
+    writeLines(spool.path("tiles.txt"), { std::to_string(spool.numTiles) });
+
+    std::vector<ProcessId> workers;
+    std::vector<long> launchedIds;
+    for (int w = 1; w < numWorkers; w++) {
+        ProcessId process;
+        if (launchWorker(executable, spool.dir, process)) {
+            workers.push_back(process);
+            launchedIds.push_back(workerProcessId(process));
+        } else {
+            printf("Could not launch a worker process.\n");
+        }
+    }
+
+    // this process is a worker as well
+    const int rendered = renderSpoolTiles(spool, frame.samples);
+
+    // the launched workers are waited for as long as they run, however long their tiles take
+    while (!workers.empty()) {
+        workers.erase(std::remove_if(workers.begin(), workers.end(), [](const ProcessId process) { return !workerRunning(process); }), workers.end());
+        if (!workers.empty()) std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    // a tile that a launched worker has claimed but not finished is rendered again right away, the tiles of workers
+    // started by hand are waited for as long as those keep on finishing some
+    auto isDone = [&spool](const int i) {
+        FILE* fp = fopen(spool.done(i).c_str(), "rb");
+        if (fp) fclose(fp);
+        return fp != NULL;
+    };
+    auto ownedByLaunchedWorker = [&spool, &launchedIds](const int i) {
+        std::vector<std::string> job;
+        if (!readLines(spool.claimed(i), job) || (job.size() < 2)) return false;
+        return std::find(launchedIds.begin(), launchedIds.end(), atol(job[1].c_str())) != launchedIds.end();
+    };
+    auto countByHand = [&spool, &isDone, &ownedByLaunchedWorker]() {
+        int missing = 0;
+        for (int i = 0; i < spool.numTiles; i++) missing += (isDone(i) || ownedByLaunchedWorker(i)) ? 0 : 1;
+        return missing;
+    };
+    int missing = countByHand();
+    auto lastProgress = std::chrono::high_resolution_clock::now();
+    while ((missing > 0) && (std::chrono::high_resolution_clock::now() - lastProgress < std::chrono::seconds(globalWorkerStallTimeout))) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        const int stillMissing = countByHand();
+        if (stillMissing < missing) lastProgress = std::chrono::high_resolution_clock::now();
+        missing = stillMissing;
+    }
+
+    // the tiles whose worker has died or stalled, or whose result is incomplete, are rendered here with all the threads
+    globalNumThreads = allThreads;
+    std::vector<float> values;
+    int recovered = 0;
+    for (int i = 0; i < spool.numTiles; i++) {
+        if (readTileResult(spool.done(i), jobs[i], values)) continue;
+        remove(spool.done(i).c_str());
+        remove(spool.tilePath("done", i, ".tmp").c_str());
+        remove(spool.claimed(i).c_str());
+        writeJob(spool, i, jobs[i]);
+        recovered++;
+    }
+    if (recovered > 0) renderSpoolTiles(spool, frame.samples);
+
+    // merge the partial sums and weights into one image
+    AccumulationBuffer.clear();
+    std::vector<float> weights(frame.width * frame.height, 0.0f);
+    int merged = 0;
+    for (int i = 0; i < spool.numTiles; i++) {
+        if (mergeTileResult(spool.done(i), jobs[i], AccumulationBuffer, weights)) {
+            merged++;
+        } else {
+            printf("Could not merge \"%s\".\n", spool.done(i).c_str());
+        }
+    }
+    for (int j = 0; j < frame.height; j++) {
+        for (int i = 0; i < frame.width; i++) {
+            const float weight = weights[i + j * frame.width];
+            FrameBuffer.pixel(i, j) = (weight > 0.0f) ? AccumulationBuffer.pixel(i, j) / weight : float3(0.0f);
+        }
+    }
+    FrameBuffer.save(frame.output.c_str());
+
+    if (!keepSpool) {
+        for (int i = 0; i < spool.numTiles; i++) {
+            remove(spool.todo(i).c_str());
+            remove(spool.claimed(i).c_str());
+            remove(spool.done(i).c_str());
+            remove(spool.tilePath("done", i, ".tmp").c_str());
+        }
+        remove(spool.path("settings.txt").c_str());
+        remove(spool.path("tiles.txt").c_str());
+        removeDirectory(spool.path("todo"));
+        removeDirectory(spool.path("claimed"));
+        removeDirectory(spool.path("done"));
+        removeDirectory(spool.dir);
+    }
+
+    auto end = std::chrono::high_resolution_clock::now();
+    if (globalShowRenderTime) {
+        printf("Render time: %lld ms (%d processes, %d of %d tiles rendered by the coordinator, %d recovered, %d merged)\n",
+            (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count(), numWorkers, rendered, spool.numTiles, recovered, merged);
+    }
+    return (merged == spool.numTiles) ? 0 : 1;
+}
+
+int main(int argc, const char* argv[]) {
+    // the multi-process options are handled here, everything else is a render option
+    std::vector<std::string> renderArgs;
+    std::string spoolDir, workerSpool;
+    int numWorkers = 0, jobTileSize = 32;
+    bool keepSpool = false, rayBenchmark = false;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        const bool hasValue = (i + 1 < argc);
+        if (arg == "-workers" && hasValue) {
+            numWorkers = std::max(1, atoi(argv[++i]));
+        } else if (arg == "-spool" && hasValue) {
+            spoolDir = argv[++i];
+        } else if (arg == "-jobtile" && hasValue) {
+            jobTileSize = std::max(2, atoi(argv[++i]) & ~1); // even, so that the 2x2 pixel blocks line up with a full frame
+        } else if (arg == "-keepspool") {
+            keepSpool = true;
+        } else if (arg == "-stalltimeout" && hasValue) {
+            globalWorkerStallTimeout = std::max(0, atoi(argv[++i]));
+        } else if (arg == "-raybench") {
+            rayBenchmark = true;
+        } else if (arg == "-worker" && hasValue) {
+            workerSpool = argv[++i];
+        } else {
+            renderArgs.push_back(arg);
+        }
+    }
+
+    // a worker takes the scene and the options from the spool (its own options come last, e.g., -threads)
+    Spool spool;
+    if (!workerSpool.empty()) {
+        std::vector<std::string> settings;
+        if (!openSpool(workerSpool, spool, settings)) return 1;
+        renderArgs.insert(renderArgs.begin(), settings.begin(), settings.end());
+    }
+
+    FrameOptions frame;
+    std::vector<std::string> positional;
+    std::string batchFile;
+    if (!parseFrameOptions(renderArgs, frame, &positional, &batchFile) || positional.empty() || (positional.size() > 2)) {
+        printf("%s", usage);
+        return 1;
+    }
+    if (((numWorkers > 0) || !workerSpool.empty()) && ((frame.renderType != RENDER_RAYTRACE) || !batchFile.empty())) {
+        printf("Multi-process rendering is for ray tracing a single frame.\n");
+        return 1;
+    }
+    if (((numWorkers > 0) || !workerSpool.empty()) && (frame.adaptiveThreshold > 0.0f)) {
+        printf("-adaptive does not work with multi-process rendering (the tiles always take -spp samples).\n");
+        return 1;
+    }
+
+    // the scene
+    static TriangleMesh mesh;
+    static PointLightSource light;
+    if (!loadScene(positional, mesh, light)) return 1;
+
+    // nothing to show progress on
+    globalShowRaytraceProgress = false;
+
+    if (rayBenchmark) {
+#ifdef CS488_SSE
+        runTraversalBenchmark(positional[0].c_str());
+        return 0;
+#else
+        printf("-raybench needs SSE.\n");
+        return 1;
+#endif
+    }
+
+    if (!workerSpool.empty()) {
+        applyFrameOptions(frame, light);
+        auto start = std::chrono::high_resolution_clock::now();
+        const int rendered = renderSpoolTiles(spool, frame.samples);
+        auto end = std::chrono::high_resolution_clock::now();
+        if (globalShowRenderTime) {
+            printf("Worker rendered %d tiles in %lld ms\n", rendered, (long long)std::chrono::duration_cast<std::chrono::milliseconds>(end - start).count());
+        }
+        return 0;
+    }
+
+    if (numWorkers > 0) {
+        applyFrameOptions(frame, light);
+        if (spoolDir.empty()) spoolDir = frame.output + ".spool";
+        return renderDistributed(frame, renderArgs, spoolDir, numWorkers, jobTileSize, keepSpool, argv[0]);
+    }
+
+    if (batchFile.empty()) {
+        renderFrame(frame, light);
+        return 0;
+    }
+
+    FILE* fp = fopen(batchFile.c_str(), "r");
+    if (!fp) {
+        printf("Could not open \"%s\".\n", batchFile.c_str());
+        return 1;
+    }
+    char line[4096];
+    int frames = 0, lineNumber = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        std::vector<std::string> args;
+        for (char* token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) args.push_back(token);
+        if (args.empty() || (args[0][0] == '#')) continue;
+
+        FrameOptions batchFrame = frame;
+        if (!parseFrameOptions(args, batchFrame, NULL, NULL)) {
+            printf("Skipping line %d of \"%s\".\n", lineNumber, batchFile.c_str());
+            continue;
+        }
+        globalFrameCount = frames; // a new jitter pattern for every frame
+        renderFrame(batchFrame, light);
+        frames++;
+    }
+    fclose(fp);
+    printf("Rendered %d frames.\n", frames);
+    return 0;
+}
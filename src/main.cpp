@@ -4,10 +4,10 @@ CS488Window CS488;
  
 // draw something in each frame
 static void draw() {
-    float2 center = float2(globalWidth * 0.5f, globalHeight * 0.5f);
+    float2 center = float2(FrameBuffer.width * 0.5f, FrameBuffer.height * 0.5f);
     float radius = 10.0f + 0.2f * globalFrameCount;
-    for (int j = 0; j < globalHeight; j++) {
-        for (int i = 0; i < globalWidth; i++) {
+    for (int j = 0; j < FrameBuffer.height; j++) {
+        for (int i = 0; i < FrameBuffer.width; i++) {
             //FrameBuffer.pixel(i, j) = float3(PCG32::rand()); // noise
             //FrameBuffer.pixel(i, j) = float3(0.5f * (cos((i + globalFrameCount) * 0.1f) + 1.0f)); // moving cosine
             float dist = length(float2(i, j) - center);
@@ -39,6 +39,35 @@ static void setupLightSource() {
 
 
 
+// command line options
+// they are removed from argv, so the remaining arguments are the .obj file and the environment map as before
+//   -res WxH : render resolution (default 512x384)
+//   -bench   : ray trace the scene at several resolutions, print the timings and exit
+//   -bvhcache dir : reuse the BVHs of the .obj files from the existing directory "dir", and save the ones built there
+static bool runBenchmark = false;
+static void parseOptions(int& argc, const char* argv[]) {
+    int n = 1;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-res") == 0) && (i + 1 < argc)) {
+            int w, h;
+            if (sscanf(argv[++i], "%dx%d", &w, &h) == 2) {
+                setResolution(w, h);
+            } else {
+                printf("Invalid resolution \"%s\", expected WxH.\n", argv[i]);
+            }
+        } else if (strcmp(argv[i], "-bench") == 0) {
+            runBenchmark = true;
+        } else if ((strcmp(argv[i], "-bvhcache") == 0) && (i + 1 < argc)) {
+            globalBVHCacheDir = argv[++i];
+        } else {
+            argv[n++] = argv[i];
+        }
+    }
+    argc = n;
+}
+
+
+
 // ======== you probably don't need to modify below in A1 to A3 ========
 // loading .obj file from the command line arguments
 static TriangleMesh mesh;
@@ -86,6 +115,15 @@ static void A3(int argc, const char* argv[]) {
 
 
 int main(int argc, const char* argv[]) {
+    parseOptions(argc, argv);
+    if (runBenchmark) {
+        setupScene(argc, argv);
+        setupLightSource();
+        globalScene.preCalc();
+        runResolutionBenchmark();
+        return 0;
+    }
+
     //A0(argc, argv);
     //A1(argc, argv);
     A2(argc, argv);